@@ -2,6 +2,14 @@
 #include <mupdf/fitz.h>
 #include <pthread.h>
 #include <tesseract/capi.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "../media/media.h"
 #include "../arc/arc.h"
@@ -13,6 +21,8 @@
 __thread text_buffer_t thread_buffer;
 __thread scan_ebook_ctx_t thread_ctx;
 
+static __thread fz_context *thread_fzctx = NULL;
+
 pthread_mutex_t Mutex;
 
 static void my_fz_lock(UNUSED(void *user), int lock) {
@@ -28,11 +38,38 @@ static void my_fz_unlock(UNUSED(void *user), int lock) {
 }
 
 
+// Largest difference of a sample with the first one on a blank page (scanner noise)
+#define BLANK_TOLERANCE 8
+
+/*
+ * A page is blank when all of its samples are within BLANK_TOLERANCE of the
+ * first sample. Returns on the first sample that is not.
+ */
 int pixmap_is_blank(const fz_pixmap *pixmap) {
-    int pixmap_size = pixmap->n * pixmap->w * pixmap->h;
-    const int pixel0 = pixmap->samples[0];
-    for (int i = 0; i < pixmap_size; i++) {
-        if (pixmap->samples[i] != pixel0) {
+    const unsigned char *samples = pixmap->samples;
+    size_t pixmap_size = (size_t) pixmap->n * pixmap->w * pixmap->h;
+    const unsigned char pixel0 = samples[0];
+
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i ref = _mm_set1_epi8((char) pixel0);
+    const __m128i tolerance = _mm_set1_epi8(BLANK_TOLERANCE);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= pixmap_size; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (samples + i));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(block, ref), _mm_subs_epu8(ref, block));
+        __m128i over = _mm_subs_epu8(diff, tolerance);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(over, zero)) != 0xFFFF) {
+            return FALSE;
+        }
+    }
+#endif
+
+    for (; i < pixmap_size; i++) {
+        int diff = samples[i] - pixel0;
+        if (diff > BLANK_TOLERANCE || diff < -BLANK_TOLERANCE) {
             return FALSE;
         }
     }
@@ -98,73 +135,41 @@ load_pixmap(scan_ebook_ctx_t *ctx, int page, fz_context *fzctx, fz_document *fzd
     return pixmap;
 }
 
-int render_cover(scan_ebook_ctx_t *ctx, fz_context *fzctx, document_t *doc, fz_document *fzdoc) {
+#define DEFAULT_COVER_SEARCH_PAGES 2
+
+int render_cover(scan_ebook_ctx_t *ctx, fz_context *fzctx, document_t *doc, fz_document *fzdoc, int page_count) {
+
+    int search_pages = ctx->tn_cover_search_pages > 0 ? ctx->tn_cover_search_pages : DEFAULT_COVER_SEARCH_PAGES;
+    search_pages = MAX(MIN(search_pages, page_count), 1);
 
     fz_page *cover = NULL;
-    fz_pixmap *pixmap = load_pixmap(ctx, 0, fzctx, fzdoc, doc, &cover);
-    if (pixmap == NULL) {
-        return FALSE;
-    }
+    fz_pixmap *pixmap = NULL;
+
+    // Use the first non-blank page, or the last page searched if they are all blank
+    for (int page = 0; page < search_pages; page++) {
+        if (pixmap != NULL) {
+            fz_drop_page(fzctx, cover);
+            fz_drop_pixmap(fzctx, pixmap);
+            CTX_LOG_DEBUGF(doc->filepath, "Cover page is blank, using page %d instead", page)
+        }
 
-    if (pixmap_is_blank(pixmap)) {
-        fz_drop_page(fzctx, cover);
-        fz_drop_pixmap(fzctx, pixmap);
-        CTX_LOG_DEBUG(doc->filepath, "Cover page is blank, using page 1 instead")
-        pixmap = load_pixmap(ctx, 1, fzctx, fzdoc, doc, &cover);
+        pixmap = load_pixmap(ctx, page, fzctx, fzdoc, doc, &cover);
         if (pixmap == NULL) {
             return FALSE;
         }
-    }
-
-    // RGB24 -> YUV420p
-    AVFrame *scaled_frame = av_frame_alloc();
-
-    struct SwsContext *sws_ctx = sws_getContext(
-            pixmap->w, pixmap->h, AV_PIX_FMT_RGB24,
-            pixmap->w, pixmap->h, AV_PIX_FMT_YUV420P,
-            SIST_SWS_ALGO, 0, 0, 0
-    );
-
-    int dst_buf_len = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, pixmap->w, pixmap->h, 1);
-    uint8_t *dst_buf = (uint8_t *) av_malloc(dst_buf_len);
-
-    av_image_fill_arrays(scaled_frame->data, scaled_frame->linesize, dst_buf, AV_PIX_FMT_YUV420P, pixmap->w, pixmap->h,
-                         1);
 
-    unsigned char *samples = calloc(1, 1024 * 1024 * 1024);
-    memcpy(samples, pixmap->samples, pixmap->stride * pixmap->h);
+        if (!pixmap_is_blank(pixmap)) {
+            break;
+        }
+    }
 
-    const uint8_t *in_data[1] = {samples,};
+    // The pixmap is already packed RGB24, swscale can read it in place
+    const uint8_t *in_data[1] = {pixmap->samples,};
     int in_line_size[1] = {(int) pixmap->stride};
 
-    sws_scale(sws_ctx,
-              in_data, in_line_size,
-              0, pixmap->h,
-              scaled_frame->data, scaled_frame->linesize
-    );
-
-    scaled_frame->width = pixmap->w;
-    scaled_frame->height = pixmap->h;
-    scaled_frame->format = AV_PIX_FMT_YUV420P;
-
-    sws_freeContext(sws_ctx);
-
-    // YUV420p -> JPEG
-    AVCodecContext *jpeg_encoder = alloc_jpeg_encoder(pixmap->w, pixmap->h, ctx->tn_qscale);
-    avcodec_send_frame(jpeg_encoder, scaled_frame);
-
-    AVPacket jpeg_packet;
-    av_init_packet(&jpeg_packet);
-    avcodec_receive_packet(jpeg_encoder, &jpeg_packet);
-
-    APPEND_TN_META(doc, pixmap->w, pixmap->h)
-    ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) jpeg_packet.data, jpeg_packet.size);
-
-    free(samples);
-    av_packet_unref(&jpeg_packet);
-    av_free(*scaled_frame->data);
-    av_frame_free(&scaled_frame);
-    avcodec_free_context(&jpeg_encoder);
+    // The pixmap was rendered at tn_size
+    thumbnail_store_sizes(ctx->store, doc, in_data, in_line_size, pixmap->w, pixmap->h, AV_PIX_FMT_RGB24,
+                          MAX(pixmap->w, pixmap->h), ctx->tn_sizes, ctx->tn_qscale, 0, ctx->tn_dhash);
 
     fz_drop_pixmap(fzctx, pixmap);
     fz_drop_page(fzctx, cover);
@@ -172,21 +177,20 @@ int render_cover(scan_ebook_ctx_t *ctx, fz_context *fzctx, document_t *doc, fz_d
     return TRUE;
 }
 
-void fz_err_callback(void *user, const char *message) {
-    document_t *doc = (document_t *) user;
+// Between documents (store eviction, cleanup_ebook()...) there is no document to log for
+#define FZ_CALLBACK_FILEPATH(user) ((user) != NULL ? ((document_t *) (user))->filepath : "ebook.c")
 
+void fz_err_callback(void *user, const char *message) {
     const scan_ebook_ctx_t *ctx = &thread_ctx;
-    CTX_LOG_WARNINGF(doc->filepath, "FZ: %s", message)
+    CTX_LOG_WARNINGF(FZ_CALLBACK_FILEPATH(user), "FZ: %s", message)
 }
 
 void fz_warn_callback(void *user, const char *message) {
-    document_t *doc = (document_t *) user;
-
     const scan_ebook_ctx_t *ctx = &thread_ctx;
-    CTX_LOG_DEBUGF(doc->filepath, "FZ: %s", message)
+    CTX_LOG_DEBUGF(FZ_CALLBACK_FILEPATH(user), "FZ: %s", message)
 }
 
-static void init_fzctx(fz_context *fzctx, document_t *doc) {
+static void init_fzctx(fz_context *fzctx) {
     fz_register_document_handlers(fzctx);
 
     static int mu_is_initialized = FALSE;
@@ -195,15 +199,43 @@ static void init_fzctx(fz_context *fzctx, document_t *doc) {
         mu_is_initialized = TRUE;
     }
 
-    fzctx->warn.print_user = doc;
     fzctx->warn.print = fz_warn_callback;
-    fzctx->error.print_user = doc;
     fzctx->error.print = fz_err_callback;
 
     fzctx->locks.lock = my_fz_lock;
     fzctx->locks.unlock = my_fz_unlock;
 }
 
+/*
+ * The fz_context lives for as long as the thread so that the resource store
+ * (built-in fonts, CMaps, glyph cache...) is kept warm between documents.
+ */
+static fz_context *get_fzctx(scan_ebook_ctx_t *ctx, document_t *doc) {
+    if (thread_fzctx == NULL) {
+        size_t store_size = ctx->mupdf_store_size > 0 ? ctx->mupdf_store_size : FZ_STORE_DEFAULT;
+        thread_fzctx = fz_new_context(NULL, NULL, store_size);
+        if (thread_fzctx == NULL) {
+            return NULL;
+        }
+        init_fzctx(thread_fzctx);
+    }
+
+    thread_fzctx->warn.print_user = doc;
+    thread_fzctx->error.print_user = doc;
+
+    return thread_fzctx;
+}
+
+/*
+ * The context outlives the document, don't keep a pointer to it
+ */
+static void release_fzctx() {
+    if (thread_fzctx != NULL) {
+        thread_fzctx->warn.print_user = NULL;
+        thread_fzctx->error.print_user = NULL;
+    }
+}
+
 static int read_stext_block(fz_stext_block *block, text_buffer_t *tex) {
     if (block->type != FZ_STEXT_BLOCK_TEXT) {
         return 0;
@@ -257,13 +289,160 @@ void fill_image(fz_context *fzctx, UNUSED(fz_device *dev),
     }
 }
 
-void
-parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mime_str, document_t *doc, int tn_only) {
+#define DEFAULT_SAMPLE_HEAD 4
+#define DEFAULT_SAMPLE_PAGES 32
 
-    fz_context *fzctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
-    thread_ctx = *ctx;
+/*
+ * Pages to extract text from, in reading order. In EBOOK_PAGES_SPREAD mode: the
+ * first few pages, then pages evenly spaced across the document and the last page.
+ */
+static int *select_pages(scan_ebook_ctx_t *ctx, int page_count, int *len) {
+
+    int max_pages = ctx->max_pages > 0 ? ctx->max_pages : page_count;
+    if (ctx->page_sample_mode == EBOOK_PAGES_SPREAD && ctx->max_pages <= 0) {
+        max_pages = DEFAULT_SAMPLE_PAGES;
+    }
+
+    int *pages = malloc(sizeof(int) * MAX(MIN(page_count, max_pages), 1));
+    *len = 0;
+
+    if (ctx->page_sample_mode != EBOOK_PAGES_SPREAD || page_count <= max_pages) {
+        for (int i = 0; i < MIN(page_count, max_pages); i++) {
+            pages[(*len)++] = i;
+        }
+        return pages;
+    }
+
+    int head = MIN(ctx->page_sample_head > 0 ? ctx->page_sample_head : DEFAULT_SAMPLE_HEAD, max_pages - 1);
+    for (int i = 0; i < head; i++) {
+        pages[(*len)++] = i;
+    }
+
+    int spread = max_pages - head - 1;
+    for (int i = 1; i <= spread; i++) {
+        int page = head + (int) ((long) i * (page_count - 1 - head) / (spread + 1));
+        if (*len == 0 || page > pages[*len - 1]) {
+            pages[(*len)++] = page;
+        }
+    }
 
-    init_fzctx(fzctx, doc);
+    if (*len == 0 || pages[*len - 1] != page_count - 1) {
+        pages[(*len)++] = page_count - 1;
+    }
+
+    return pages;
+}
+
+static long count_stext_chars(fz_stext_page *stext) {
+    long count = 0;
+    for (fz_stext_block *block = stext->first_block; block != NULL; block = block->next) {
+        if (block->type != FZ_STEXT_BLOCK_TEXT) {
+            continue;
+        }
+        for (fz_stext_line *line = block->u.t.first_line; line != NULL; line = line->next) {
+            for (fz_stext_char *c = line->first_char; c != NULL; c = c->next) {
+                count += 1;
+            }
+        }
+    }
+    return count;
+}
+
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+#define PREAD_STREAM_BUF_SIZE (1024 * 16)
+
+typedef struct {
+    int fd;
+    int64_t size;
+    unsigned char buf[PREAD_STREAM_BUF_SIZE];
+} pread_stream_t;
+
+static int pread_stream_next(fz_context *fzctx, fz_stream *stm, UNUSED(size_t max)) {
+    pread_stream_t *state = stm->state;
+
+    ssize_t n = pread(state->fd, state->buf, sizeof(state->buf), stm->pos);
+    if (n < 0) {
+        fz_throw(fzctx, FZ_ERROR_GENERIC, "pread() failed: %s", strerror(errno));
+    }
+
+    stm->rp = state->buf;
+    stm->wp = state->buf + n;
+    stm->pos += n;
+
+    if (n == 0) {
+        return EOF;
+    }
+    return *stm->rp++;
+}
+
+static void pread_stream_seek(fz_context *fzctx, fz_stream *stm, int64_t offset, int whence) {
+    pread_stream_t *state = stm->state;
+
+    // fz_seek() already turned SEEK_CUR into SEEK_SET
+    int64_t pos = whence == SEEK_END ? state->size + offset : offset;
+    if (pos < 0) {
+        fz_throw(fzctx, FZ_ERROR_GENERIC, "cannot seek to negative offset %ld", (long) pos);
+    }
+
+    stm->pos = MIN(pos, state->size);
+    stm->rp = state->buf;
+    stm->wp = state->buf;
+}
+
+static void pread_stream_drop(fz_context *fzctx, void *opaque) {
+    pread_stream_t *state = opaque;
+    close(state->fd);
+    fz_free(fzctx, state);
+}
+
+/*
+ * Random-access stream over a file on disk: mupdf only reads the parts of
+ * the document it needs instead of the whole file being loaded in memory.
+ */
+static fz_stream *open_pread_stream(fz_context *fzctx, const char *filepath) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd == -1) {
+        fz_throw(fzctx, FZ_ERROR_GENERIC, "open() failed: %s", strerror(errno));
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        fz_throw(fzctx, FZ_ERROR_GENERIC, "fstat() failed: %s", strerror(errno));
+    }
+
+    pread_stream_t *state = fz_malloc_no_throw(fzctx, sizeof(pread_stream_t));
+    if (state == NULL) {
+        close(fd);
+        fz_throw(fzctx, FZ_ERROR_MEMORY, "cannot allocate pread stream");
+    }
+    state->fd = fd;
+    state->size = info.st_size;
+
+    // fz_new_stream() drops the state if it throws
+    fz_stream *stm = fz_new_stream(fzctx, state, pread_stream_next, pread_stream_drop);
+    stm->seek = pread_stream_seek;
+
+    return stm;
+}
+
+/*
+ * Opens the document from filepath when it is not NULL, otherwise from buf
+ */
+static void parse_ebook_impl(scan_ebook_ctx_t *ctx, const char *filepath, void *buf, size_t buf_len,
+                             const char *mime_str, document_t *doc, int tn_only) {
+
+    fz_context *fzctx = get_fzctx(ctx, doc);
+    if (fzctx == NULL) {
+        CTX_LOG_ERROR(doc->filepath, "fz_new_context() failed")
+        return;
+    }
+    thread_ctx = *ctx;
 
     int err = 0;
 
@@ -274,14 +453,17 @@ parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mi
     fz_var(err);
 
     fz_try(fzctx) {
-                stream = fz_open_memory(fzctx, buf, buf_len);
+                if (filepath != NULL) {
+                    stream = open_pread_stream(fzctx, filepath);
+                } else {
+                    stream = fz_open_memory(fzctx, buf, buf_len);
+                }
                 fzdoc = fz_open_document_with_stream(fzctx, mime_str, stream);
             } fz_catch(fzctx)err = fzctx->error.errcode;
 
     if (err != 0) {
         fz_drop_stream(fzctx, stream);
         fz_drop_document(fzctx, fzdoc);
-        fz_drop_context(fzctx);
         return;
     }
 
@@ -294,17 +476,15 @@ parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mi
         CTX_LOG_WARNINGF(doc->filepath, "fz_count_pages() returned error code [%d] %s", err, fzctx->error.message)
         fz_drop_stream(fzctx, stream);
         fz_drop_document(fzctx, fzdoc);
-        fz_drop_context(fzctx);
         return;
     }
 
     APPEND_LONG_META(doc, MetaPages, page_count)
 
     if (ctx->tn_size > 0) {
-        if (render_cover(ctx, fzctx, doc, fzdoc) == FALSE) {
+        if (render_cover(ctx, fzctx, doc, fzdoc, page_count) == FALSE) {
             fz_drop_stream(fzctx, stream);
             fz_drop_document(fzctx, fzdoc);
-            fz_drop_context(fzctx);
             return;
         }
     }
@@ -312,7 +492,6 @@ parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mi
     if (tn_only) {
         fz_drop_stream(fzctx, stream);
         fz_drop_document(fzctx, fzdoc);
-        fz_drop_context(fzctx);
         return;
     }
 
@@ -337,10 +516,24 @@ parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mi
         fz_stext_options opts = {0};
         thread_buffer = text_buffer_create(ctx->content_size);
 
-        for (int current_page = 0; current_page < page_count; current_page++) {
+        int page_list_len;
+        int *pages = select_pages(ctx, page_count, &page_list_len);
+
+        // When sampling, each page gets an equal share of the content buffer
+        long page_quota = ctx->page_sample_mode == EBOOK_PAGES_SPREAD
+                          ? MAX(ctx->content_size / MAX(page_list_len, 1), 1)
+                          : ctx->content_size;
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        int pages_read = 0;
+        long text_len = 0;
+
+        for (int i = 0; i < page_list_len; i++) {
             fz_page *page = NULL;
             fz_var(err);
-            fz_try(fzctx)page = fz_load_page(fzctx, fzdoc, current_page);
+            fz_try(fzctx)page = fz_load_page(fzctx, fzdoc, pages[i]);
             fz_catch(fzctx)err = fzctx->error.errcode;
             if (err != 0) {
                 CTX_LOG_WARNINGF(doc->filepath, "fz_load_page() returned error code [%d] %s", err, fzctx->error.message)
@@ -348,7 +541,7 @@ parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mi
                 fz_drop_page(fzctx, page);
                 fz_drop_stream(fzctx, stream);
                 fz_drop_document(fzctx, fzdoc);
-                fz_drop_context(fzctx);
+                free(pages);
                 return;
             }
 
@@ -378,27 +571,41 @@ parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mi
                 fz_drop_stext_page(fzctx, stext);
                 fz_drop_stream(fzctx, stream);
                 fz_drop_document(fzctx, fzdoc);
-                fz_drop_context(fzctx);
+                free(pages);
                 return;
             }
 
+            size_t page_start = thread_buffer.dyn_buffer.cur;
             fz_stext_block *block = stext->first_block;
             while (block != NULL) {
                 int ret = read_stext_block(block, &thread_buffer);
-                if (ret == TEXT_BUF_FULL) {
+                if (ret == TEXT_BUF_FULL || (long) (thread_buffer.dyn_buffer.cur - page_start) >= page_quota) {
                     break;
                 }
                 block = block->next;
             }
+            text_len += count_stext_chars(stext);
+            pages_read += 1;
+
             fz_drop_stext_page(fzctx, stext);
             fz_drop_page(fzctx, page);
 
             if (thread_buffer.dyn_buffer.cur >= ctx->content_size) {
                 break;
             }
+
+            if (ctx->page_time_budget_ms > 0 && elapsed_ms(&start) >= ctx->page_time_budget_ms) {
+                CTX_LOG_DEBUGF(doc->filepath, "Page time budget exceeded after %d/%d pages", pages_read, page_count)
+                break;
+            }
         }
+        free(pages);
         text_buffer_terminate_string(&thread_buffer);
 
+        if (pages_read > 0) {
+            APPEND_LONG_META(doc, MetaEstimatedContentSize, text_len * page_count / pages_read)
+        }
+
         meta_line_t *meta_content = malloc(sizeof(meta_line_t) + thread_buffer.dyn_buffer.cur);
         meta_content->key = MetaContent;
         memcpy(meta_content->str_val, thread_buffer.dyn_buffer.buf, thread_buffer.dyn_buffer.cur);
@@ -409,80 +616,33 @@ parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mi
 
     fz_drop_stream(fzctx, stream);
     fz_drop_document(fzctx, fzdoc);
-    fz_drop_context(fzctx);
 }
 
-static scan_arc_ctx_t arc_ctx = (scan_arc_ctx_t) {.passphrase = {0,}};
-
-void parse_epub_fast(scan_ebook_ctx_t *ctx, vfile_t *f, document_t *doc) {
-    struct archive *a = NULL;
-    struct archive_entry *entry = NULL;
-    arc_data_t arc_data;
-
-    text_buffer_t content_buffer = text_buffer_create(ctx->content_size);
+void
+parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mime_str, document_t *doc, int tn_only) {
+    parse_ebook_impl(ctx, NULL, buf, buf_len, mime_str, doc, tn_only);
+    release_fzctx();
+}
 
-    if (ctx->tn_size <= 0) {
-        return;
-    }
+void parse_ebook(scan_ebook_ctx_t *ctx, vfile_t *f, const char *mime_str, document_t *doc) {
 
-    int ret = arc_open(&arc_ctx, f, &a, &arc_data, TRUE);
-    if (ret != ARCHIVE_OK) {
-        CTX_LOG_ERRORF(f->filepath, "(ebook.c) [%d] %s", ret, archive_error_string(a))
-        archive_read_free(a);
+    if (ctx->fast_epub_parse && is_epub(mime_str)) {
+        parse_epub_fast(ctx, f, doc);
         return;
     }
 
-    while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
-        struct stat info = *archive_entry_stat(entry);
-        if (S_ISREG(info.st_mode)) {
-            const char *utf8_name = archive_entry_pathname_utf8(entry);
-            const char *file_path = utf8_name == NULL ? archive_entry_pathname(entry) : utf8_name;
-
-            char *p = strrchr(file_path, '.');
-            if (p != NULL && (strcmp(p, ".html") == 0 || (strcmp(p, ".xhtml") == 0))) {
-                size_t entry_size = archive_entry_size(entry);
-                void *buf = malloc(entry_size + 1);
-                size_t read = archive_read_data(a, buf, entry_size);
-                *(char *) (buf + entry_size) = '\0';
-
-                if (read != entry_size) {
-                    const char *err_str = archive_error_string(a);
-                    if (err_str) {
-                        CTX_LOG_ERRORF("ebook.c", "Error while reading entry: %s", err_str)
-                    }
-                    free(buf);
-                    break;
-                }
+    if (f->is_fs_file) {
+        parse_ebook_impl(ctx, f->filepath, NULL, 0, mime_str, doc, FALSE);
+        release_fzctx();
 
-                ret = text_buffer_append_markup(&content_buffer, buf);
-                free(buf);
-
-                if (ret == TEXT_BUF_FULL) {
-                    break;
-                }
-            }
+        if (f->calculate_checksum) {
+            // mupdf did not go through f->read()
+            vfile_read_to_end(f);
         }
-    }
-
-    text_buffer_terminate_string(&content_buffer);
-
-    meta_line_t *meta_content = malloc(sizeof(meta_line_t) + content_buffer.dyn_buffer.cur);
-    meta_content->key = MetaContent;
-    memcpy(meta_content->str_val, content_buffer.dyn_buffer.buf, content_buffer.dyn_buffer.cur);
-    APPEND_META(doc, meta_content)
-
-    text_buffer_destroy(&content_buffer);
-
-    archive_read_free(a);
-}
-
-void parse_ebook(scan_ebook_ctx_t *ctx, vfile_t *f, const char *mime_str, document_t *doc) {
-
-    if (ctx->fast_epub_parse && is_epub(mime_str)) {
-        parse_epub_fast(ctx, f, doc);
         return;
     }
 
+    // Archive entries can't be read out of order, load them in memory
     size_t buf_len;
     void *buf = read_all(f, &buf_len);
     if (buf == NULL) {
@@ -493,3 +653,10 @@ void parse_ebook(scan_ebook_ctx_t *ctx, vfile_t *f, const char *mime_str, docume
     parse_ebook_mem(ctx, buf, buf_len, mime_str, doc, FALSE);
     free(buf);
 }
+
+void cleanup_ebook() {
+    if (thread_fzctx != NULL) {
+        fz_drop_context(thread_fzctx);
+        thread_fzctx = NULL;
+    }
+}
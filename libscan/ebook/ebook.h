@@ -2,6 +2,10 @@
 #define SCAN_EBOOK_H
 
 #include "../scan.h"
+#include "../thumbnail/thumbnail.h"
+
+#define EBOOK_PAGES_SEQUENTIAL 0
+#define EBOOK_PAGES_SPREAD 1
 
 typedef struct {
     long content_size;
@@ -15,6 +19,24 @@ typedef struct {
     store_callback_t store;
     int fast_epub_parse;
     float tn_qscale;
+    // Number of leading pages searched for a non-blank cover (0 for default)
+    int tn_cover_search_pages;
+    // Resource store size of the per-thread mupdf context, 0 for FZ_STORE_DEFAULT
+    size_t mupdf_store_size;
+
+    // Which pages text is extracted from, see EBOOK_PAGES_*
+    int page_sample_mode;
+    // EBOOK_PAGES_SPREAD: number of leading pages always read (0 for default)
+    int page_sample_head;
+    // Maximum number of pages read per document (0 for all pages, or default when sampling)
+    int max_pages;
+    // Stop extracting text after this many milliseconds (0 for no limit)
+    long page_time_budget_ms;
+
+    // Smaller cover thumbnails also stored, 0-terminated (see thumbnail_store_sizes())
+    int tn_sizes[THUMBNAIL_MAX_SIZES];
+    // Append the difference hash of the cover thumbnail (MetaThumbnailDHash)
+    int tn_dhash;
 } scan_ebook_ctx_t;
 
 void parse_ebook(scan_ebook_ctx_t *ctx, vfile_t *f, const char *mime_str, document_t *doc);
@@ -22,6 +44,10 @@ void parse_ebook(scan_ebook_ctx_t *ctx, vfile_t *f, const char *mime_str, docume
 void
 parse_ebook_mem(scan_ebook_ctx_t *ctx, void *buf, size_t buf_len, const char *mime_str, document_t *doc, int tn_only);
 
+void parse_epub_fast(scan_ebook_ctx_t *ctx, vfile_t *f, document_t *doc);
+
+void cleanup_ebook();
+
 __always_inline
 static int is_epub(const char *mime_string) {
     return strcmp(mime_string, "application/epub+zip") == 0;
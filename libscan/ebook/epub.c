@@ -0,0 +1,542 @@
+#include "ebook.h"
+#include "../media/media.h"
+#include "../arc/arc.h"
+
+#include <ctype.h>
+#include <libxml/parser.h>
+#include <libxml/xmlstring.h>
+
+#define _X(str) ((const xmlChar*)str)
+
+#define EPUB_CONTAINER_PATH "META-INF/container.xml"
+#define EPUB_MAX_XML_SIZE (1024 * 1024 * 4)
+#define EPUB_MAX_COVER_SIZE (1024 * 1024 * 32)
+#define EPUB_CHUNK_SIZE (1024 * 16)
+#define EPUB_MAX_PASSES 3
+
+typedef struct {
+    char *id;
+    char *path;
+    char *media_type;
+} epub_manifest_item_t;
+
+typedef struct {
+    char *opf_path;
+    char *cover_path;
+
+    char **spine;
+    int spine_len;
+    // Index of the next spine document to read
+    int spine_cursor;
+    char *spine_done;
+} epub_t;
+
+typedef struct {
+    vfile_t *f;
+    void *buf;
+    size_t buf_len;
+} epub_source_t;
+
+static struct archive *epub_open(epub_source_t *src) {
+    struct archive *a = archive_read_new();
+    archive_read_support_format_zip_seekable(a);
+
+    int ret;
+    if (src->buf == NULL) {
+        ret = archive_read_open_filename(a, src->f->filepath, ARC_BUF_SIZE);
+    } else {
+        ret = archive_read_open_memory(a, src->buf, src->buf_len);
+    }
+
+    if (ret != ARCHIVE_OK) {
+        src->f->logf(src->f->filepath, LEVEL_ERROR, "(epub.c) [%d] %s", ret, archive_error_string(a));
+        archive_read_free(a);
+        return NULL;
+    }
+    return a;
+}
+
+static const char *epub_entry_path(struct archive_entry *entry) {
+    const char *utf8_name = archive_entry_pathname_utf8(entry);
+    return utf8_name == NULL ? archive_entry_pathname(entry) : utf8_name;
+}
+
+/*
+ * Only used for small entries (XML, cover image), documents are streamed
+ */
+static void *epub_read_entry(struct archive *a, struct archive_entry *entry, size_t max_size, size_t *size) {
+    long entry_size = archive_entry_size(entry);
+    if (entry_size <= 0 || entry_size > max_size) {
+        return NULL;
+    }
+
+    char *buf = malloc(entry_size + 1);
+    if (archive_read_data(a, buf, entry_size) != entry_size) {
+        free(buf);
+        return NULL;
+    }
+    buf[entry_size] = '\0';
+
+    *size = entry_size;
+    return buf;
+}
+
+static xmlDoc *epub_read_xml(struct archive *a, struct archive_entry *entry) {
+    size_t size;
+    char *buf = epub_read_entry(a, entry, EPUB_MAX_XML_SIZE, &size);
+    if (buf == NULL) {
+        return NULL;
+    }
+
+    xmlDoc *xml = xmlReadMemory(buf, (int) size, "/", NULL,
+                                XML_PARSE_RECOVER | XML_PARSE_NOWARNING | XML_PARSE_NOERROR | XML_PARSE_NONET);
+    free(buf);
+    return xml;
+}
+
+static char *epub_get_prop(xmlNode *node, const char *name) {
+    xmlChar *value = xmlGetProp(node, _X(name));
+    if (value == NULL) {
+        return NULL;
+    }
+    char *str = strdup((char *) value);
+    xmlFree(value);
+    return str;
+}
+
+static char *epub_read_container(xmlDoc *xml) {
+    xmlNode *root = xmlDocGetRootElement(xml);
+    if (root == NULL) {
+        return NULL;
+    }
+
+    for (xmlNode *child = root->children; child; child = child->next) {
+        if (!xmlStrEqual(child->name, _X("rootfiles"))) {
+            continue;
+        }
+        for (xmlNode *rootfile = child->children; rootfile; rootfile = rootfile->next) {
+            if (xmlStrEqual(rootfile->name, _X("rootfile"))) {
+                return epub_get_prop(rootfile, "full-path");
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Resolve a (percent-encoded) manifest href relative to the OPF directory
+ */
+static char *epub_resolve_path(const char *opf_path, const char *href) {
+    const char *opf_dir_end = strrchr(opf_path, '/');
+    size_t dir_len = opf_dir_end == NULL ? 0 : opf_dir_end - opf_path + 1;
+
+    char *path = malloc(dir_len + strlen(href) + 1);
+    memcpy(path, opf_path, dir_len);
+
+    char *out = path + dir_len;
+    for (const char *ptr = href; *ptr != '\0' && *ptr != '#'; ptr++) {
+        if (*ptr == '%' && isxdigit(ptr[1]) && isxdigit(ptr[2])) {
+            char hex[3] = {ptr[1], ptr[2], '\0'};
+            *out++ = (char) strtol(hex, NULL, 16);
+            ptr += 2;
+        } else {
+            *out++ = *ptr;
+        }
+    }
+    *out = '\0';
+
+    // Normalize segment by segment: drop empty and "." segments, ".." removes the previous one
+    char *dst = path;
+    const char *src = path;
+    while (*src != '\0') {
+        const char *end = strchr(src, '/');
+        size_t len = end == NULL ? strlen(src) : (size_t) (end - src);
+
+        if (len == 2 && src[0] == '.' && src[1] == '.') {
+            // Nothing above the root of the archive
+            if (dst > path) {
+                dst -= 1;
+            }
+            while (dst > path && *(dst - 1) != '/') {
+                dst -= 1;
+            }
+        } else if (len > 0 && !(len == 1 && src[0] == '.')) {
+            memmove(dst, src, len);
+            dst += len;
+            if (end != NULL) {
+                *dst++ = '/';
+            }
+        }
+
+        src += end == NULL ? len : len + 1;
+    }
+    *dst = '\0';
+
+    return path;
+}
+
+__always_inline
+static int is_cover_image_type(const char *media_type) {
+    return media_type != NULL && (
+            strcmp(media_type, "image/jpeg") == 0
+            || strcmp(media_type, "image/png") == 0
+            || strcmp(media_type, "image/gif") == 0
+            || strcmp(media_type, "image/webp") == 0);
+}
+
+static void epub_read_metadata(scan_ebook_ctx_t *ctx, xmlDoc *xml, xmlNode *metadata, document_t *doc,
+                               char **cover_id) {
+    int has_title = FALSE;
+    int has_author = FALSE;
+    int has_language = FALSE;
+
+    for (xmlNode *child = metadata->children; child; child = child->next) {
+        if (child->type != XML_ELEMENT_NODE) {
+            continue;
+        }
+
+        if (xmlStrEqual(child->name, _X("meta"))) {
+            // EPUB2: <meta name="cover" content="{manifest id}"/>
+            xmlChar *name = xmlGetProp(child, _X("name"));
+            if (name != NULL && xmlStrEqual(name, _X("cover")) && *cover_id == NULL) {
+                *cover_id = epub_get_prop(child, "content");
+            }
+            xmlFree(name);
+            continue;
+        }
+
+        xmlChar *text = xmlNodeListGetString(xml, child->xmlChildrenNode, 1);
+        if (text == NULL) {
+            continue;
+        }
+
+        if (!has_title && xmlStrEqual(child->name, _X("title"))) {
+            APPEND_UTF8_META(doc, MetaTitle, (char *) text)
+            has_title = TRUE;
+        } else if (!has_author && xmlStrEqual(child->name, _X("creator"))) {
+            APPEND_UTF8_META(doc, MetaAuthor, (char *) text)
+            has_author = TRUE;
+        } else if (!has_language && xmlStrEqual(child->name, _X("language"))) {
+            APPEND_UTF8_META(doc, MetaLanguage, (char *) text)
+            has_language = TRUE;
+        }
+
+        xmlFree(text);
+    }
+}
+
+static void epub_free_manifest(epub_manifest_item_t *manifest, int manifest_len) {
+    for (int i = 0; i < manifest_len; i++) {
+        free(manifest[i].id);
+        free(manifest[i].path);
+        free(manifest[i].media_type);
+    }
+    free(manifest);
+}
+
+static void epub_read_opf(scan_ebook_ctx_t *ctx, xmlDoc *xml, epub_t *epub, document_t *doc) {
+    xmlNode *root = xmlDocGetRootElement(xml);
+    if (root == NULL) {
+        return;
+    }
+
+    char *cover_id = NULL;
+    epub_manifest_item_t *manifest = NULL;
+    int manifest_len = 0;
+
+    for (xmlNode *child = root->children; child; child = child->next) {
+        if (xmlStrEqual(child->name, _X("metadata"))) {
+            epub_read_metadata(ctx, xml, child, doc, &cover_id);
+
+        } else if (xmlStrEqual(child->name, _X("manifest"))) {
+            for (xmlNode *item = child->children; item; item = item->next) {
+                if (!xmlStrEqual(item->name, _X("item"))) {
+                    continue;
+                }
+                char *href = epub_get_prop(item, "href");
+                if (href == NULL) {
+                    continue;
+                }
+
+                manifest = realloc(manifest, sizeof(epub_manifest_item_t) * (manifest_len + 1));
+                epub_manifest_item_t *manifest_item = &manifest[manifest_len++];
+                manifest_item->id = epub_get_prop(item, "id");
+                manifest_item->path = epub_resolve_path(epub->opf_path, href);
+                manifest_item->media_type = epub_get_prop(item, "media-type");
+                free(href);
+
+                // EPUB3: <item properties="cover-image" .../>
+                char *properties = epub_get_prop(item, "properties");
+                if (properties != NULL && strstr(properties, "cover-image") != NULL && epub->cover_path == NULL) {
+                    epub->cover_path = strdup(manifest_item->path);
+                }
+                free(properties);
+            }
+
+        } else if (xmlStrEqual(child->name, _X("spine"))) {
+            for (xmlNode *itemref = child->children; itemref; itemref = itemref->next) {
+                if (!xmlStrEqual(itemref->name, _X("itemref"))) {
+                    continue;
+                }
+                char *idref = epub_get_prop(itemref, "idref");
+                if (idref == NULL) {
+                    continue;
+                }
+                // The manifest always comes before the spine
+                for (int i = 0; i < manifest_len; i++) {
+                    if (manifest[i].id != NULL && strcmp(manifest[i].id, idref) == 0) {
+                        epub->spine = realloc(epub->spine, sizeof(char *) * (epub->spine_len + 1));
+                        epub->spine[epub->spine_len++] = strdup(manifest[i].path);
+                        break;
+                    }
+                }
+                free(idref);
+            }
+        }
+    }
+
+    if (epub->cover_path == NULL) {
+        for (int i = 0; i < manifest_len; i++) {
+            if (!is_cover_image_type(manifest[i].media_type) || manifest[i].id == NULL) {
+                continue;
+            }
+            if ((cover_id != NULL && strcmp(manifest[i].id, cover_id) == 0)
+                || (cover_id == NULL && strstr(manifest[i].id, "cover") != NULL)) {
+                epub->cover_path = strdup(manifest[i].path);
+                break;
+            }
+        }
+    }
+
+    epub->spine_done = calloc(epub->spine_len + 1, 1);
+
+    free(cover_id);
+    epub_free_manifest(manifest, manifest_len);
+}
+
+/*
+ * Find the OPF package, either the one declared in META-INF/container.xml,
+ * or the first .opf entry in the archive
+ */
+static int epub_find_package(scan_ebook_ctx_t *ctx, epub_source_t *src, epub_t *epub, document_t *doc) {
+
+    xmlDoc *opf = NULL;
+
+    for (int pass = 0; pass < 2 && opf == NULL; pass++) {
+        struct archive *a = epub_open(src);
+        if (a == NULL) {
+            return FALSE;
+        }
+
+        struct archive_entry *entry;
+        while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+            if (!S_ISREG(archive_entry_stat(entry)->st_mode)) {
+                continue;
+            }
+            const char *path = epub_entry_path(entry);
+
+            if (epub->opf_path == NULL && strcmp(path, EPUB_CONTAINER_PATH) == 0) {
+                xmlDoc *container = epub_read_xml(a, entry);
+                if (container != NULL) {
+                    epub->opf_path = epub_read_container(container);
+                    xmlFreeDoc(container);
+                }
+            } else if ((epub->opf_path != NULL && strcmp(path, epub->opf_path) == 0)
+                       || (pass == 1 && epub->opf_path == NULL && strstr(path, ".opf") != NULL)) {
+                if (epub->opf_path == NULL) {
+                    epub->opf_path = strdup(path);
+                }
+                opf = epub_read_xml(a, entry);
+                break;
+            }
+        }
+
+        archive_read_free(a);
+    }
+
+    if (opf == NULL) {
+        CTX_LOG_DEBUG(doc->filepath, "(epub.c) Could not find OPF package document")
+        return FALSE;
+    }
+
+    epub_read_opf(ctx, opf, epub, doc);
+    xmlFreeDoc(opf);
+    return TRUE;
+}
+
+static int epub_spine_index(epub_t *epub, const char *path) {
+    for (int i = 0; i < epub->spine_len; i++) {
+        if (!epub->spine_done[i] && strcmp(epub->spine[i], path) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int epub_stream_document(struct archive *a, text_buffer_t *tex, char *chunk) {
+    markup_state_t state;
+    markup_state_init(&state);
+
+    la_ssize_t read;
+    while ((read = archive_read_data(a, chunk, EPUB_CHUNK_SIZE)) > 0) {
+        if (text_buffer_append_markup_chunk(tex, &state, chunk, read) == TEXT_BUF_FULL) {
+            return TEXT_BUF_FULL;
+        }
+    }
+    return text_buffer_append_markup_end(tex, &state);
+}
+
+static void epub_store_cover(scan_ebook_ctx_t *ctx, struct archive *a, struct archive_entry *entry,
+                             const char *path, document_t *doc) {
+    size_t size;
+    void *buf = epub_read_entry(a, entry, EPUB_MAX_COVER_SIZE, &size);
+    if (buf == NULL) {
+        return;
+    }
+
+    scan_media_ctx_t media_ctx = {
+            .log = ctx->log,
+            .logf = ctx->logf,
+            .store = ctx->store,
+            .tn_size = ctx->tn_size,
+            .tn_qscale = ctx->tn_qscale,
+    };
+    if (store_image_thumbnail(&media_ctx, buf, size, doc, path) == FALSE) {
+        CTX_LOG_DEBUGF(doc->filepath, "(epub.c) Could not create thumbnail from cover image %s", path)
+    }
+    free(buf);
+}
+
+static int is_markup_path(const char *path) {
+    char *p = strrchr(path, '.');
+    return p != NULL && (strcmp(p, ".html") == 0 || strcmp(p, ".xhtml") == 0 || strcmp(p, ".htm") == 0);
+}
+
+/*
+ * Read the spine documents in order (and the cover image). Zip entries are
+ * usually stored in spine order, in which case this is a single pass over the
+ * archive. Otherwise, the archive is re-read (up to EPUB_MAX_PASSES times)
+ * and in the last pass the remaining documents are taken in archive order.
+ */
+static void epub_read_content(scan_ebook_ctx_t *ctx, epub_source_t *src, epub_t *epub, document_t *doc) {
+
+    int want_cover = ctx->tn_size > 0 && epub->cover_path != NULL;
+    int want_content = ctx->content_size > 0;
+
+    text_buffer_t tex = text_buffer_create(ctx->content_size);
+    char *chunk = malloc(EPUB_CHUNK_SIZE);
+
+    for (int pass = 0; pass < EPUB_MAX_PASSES && (want_cover || want_content); pass++) {
+        int last_pass = pass == EPUB_MAX_PASSES - 1;
+
+        struct archive *a = epub_open(src);
+        if (a == NULL) {
+            break;
+        }
+
+        struct archive_entry *entry;
+        while ((want_cover || want_content) && archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+            if (!S_ISREG(archive_entry_stat(entry)->st_mode)) {
+                continue;
+            }
+            const char *path = epub_entry_path(entry);
+
+            if (want_cover && strcmp(path, epub->cover_path) == 0) {
+                epub_store_cover(ctx, a, entry, path, doc);
+                want_cover = FALSE;
+                continue;
+            }
+
+            if (!want_content) {
+                continue;
+            }
+
+            int idx;
+            if (epub->spine_len == 0) {
+                // No usable OPF: read all markup documents in archive order
+                idx = is_markup_path(path) ? 0 : -1;
+            } else {
+                idx = epub_spine_index(epub, path);
+                if (idx != epub->spine_cursor && !last_pass) {
+                    idx = -1;
+                }
+            }
+            if (idx == -1) {
+                continue;
+            }
+
+            int ret = epub_stream_document(a, &tex, chunk);
+            if (ret == TEXT_BUF_FULL) {
+                want_content = FALSE;
+                break;
+            }
+
+            if (epub->spine_len != 0) {
+                epub->spine_done[idx] = TRUE;
+                while (epub->spine_cursor < epub->spine_len && epub->spine_done[epub->spine_cursor]) {
+                    epub->spine_cursor += 1;
+                }
+                if (epub->spine_cursor == epub->spine_len) {
+                    want_content = FALSE;
+                }
+            }
+        }
+
+        if (epub->spine_len == 0) {
+            want_content = FALSE;
+        }
+
+        archive_read_free(a);
+    }
+
+    if (ctx->content_size > 0) {
+        text_buffer_terminate_string(&tex);
+
+        meta_line_t *meta_content = malloc(sizeof(meta_line_t) + tex.dyn_buffer.cur);
+        meta_content->key = MetaContent;
+        memcpy(meta_content->str_val, tex.dyn_buffer.buf, tex.dyn_buffer.cur);
+        APPEND_META(doc, meta_content)
+    }
+
+    free(chunk);
+    text_buffer_destroy(&tex);
+}
+
+static void epub_destroy(epub_t *epub) {
+    for (int i = 0; i < epub->spine_len; i++) {
+        free(epub->spine[i]);
+    }
+    free(epub->spine);
+    free(epub->spine_done);
+    free(epub->opf_path);
+    free(epub->cover_path);
+}
+
+/*
+ * Reads metadata, cover and text directly from the OPF package without
+ * laying out the book with mupdf.
+ */
+void parse_epub_fast(scan_ebook_ctx_t *ctx, vfile_t *f, document_t *doc) {
+
+    epub_source_t src = {.f = f, .buf = NULL, .buf_len = 0};
+
+    if (!f->is_fs_file) {
+        // The archive is read more than once, keep the (compressed) epub in memory
+        src.buf = read_all(f, &src.buf_len);
+        if (src.buf == NULL) {
+            CTX_LOG_ERROR(f->filepath, "read_all() failed")
+            return;
+        }
+    }
+
+    epub_t epub = {0};
+    epub_find_package(ctx, &src, &epub, doc);
+    epub_read_content(ctx, &src, &epub, doc);
+    epub_destroy(&epub);
+
+    if (f->is_fs_file && f->calculate_checksum) {
+        vfile_read_to_end(f);
+    }
+
+    free(src.buf);
+}
@@ -3,6 +3,7 @@
 #include <ft2build.h>
 #include <freetype/freetype.h>
 #include "../util.h"
+#include "../thumbnail/thumbnail.h"
 
 
 __thread FT_Library ft_lib = NULL;
@@ -100,44 +101,6 @@ void draw_glyph(glyph_t *glyph, int x, int y, struct text_dimensions text_info,
     }
 }
 
-void bmp_format(dyn_buffer_t *buf, text_dimensions_t dimensions, const unsigned char *bitmap) {
-
-    dyn_buffer_write_short(buf, 0x4D42); // Magic
-    dyn_buffer_write_int(buf, 0); // Size placeholder
-    dyn_buffer_write_int(buf, 0x5157); //Reserved
-    dyn_buffer_write_int(buf, 14 + 40 + 256 * 4); // pixels offset
-
-    dyn_buffer_write_int(buf, 40); // DIB size
-    dyn_buffer_write_int(buf, (int) dimensions.width);
-    dyn_buffer_write_int(buf, (int) dimensions.height);
-    dyn_buffer_write_short(buf, 1); // Color planes
-    dyn_buffer_write_short(buf, 8); // bits per pixel
-    dyn_buffer_write_int(buf, 0); // compression
-    dyn_buffer_write_int(buf, 0); // Ignored
-    dyn_buffer_write_int(buf, 3800); // hres
-    dyn_buffer_write_int(buf, 3800); // vres
-    dyn_buffer_write_int(buf, 256); // Color count
-    dyn_buffer_write_int(buf, 0); // Ignored
-
-    // RGBA32 Color table (Grayscale)
-    for (int i = 255; i >= 0; i--) {
-        dyn_buffer_write_int(buf, i + (i << 8) + (i << 16));
-    }
-
-    // Pixel array: write from bottom to top, with rows padded to multiples of 4-bytes
-    for (int y = (int) dimensions.height - 1; y >= 0; y--) {
-        for (unsigned int x = 0; x < dimensions.width; x++) {
-            dyn_buffer_write_char(buf, (char) bitmap[y * dimensions.width + x]);
-        }
-        while (buf->cur % 4 != 0) {
-            dyn_buffer_write_char(buf, 0);
-        }
-    }
-
-    // Size
-    *(int *) ((char *) buf->buf + 2) = buf->cur;
-}
-
 void parse_font(scan_font_ctx_t *ctx, vfile_t *f, document_t *doc) {
     if (ft_lib == NULL) {
         FT_Init_FreeType(&ft_lib);
@@ -228,13 +191,20 @@ void parse_font(scan_font_ctx_t *ctx, vfile_t *f, document_t *doc) {
         pc = c;
     }
 
-    dyn_buffer_t bmp_data = dyn_buffer_create();
-    bmp_format(&bmp_data, dimensions, bitmap);
+    // Black text on a white background
+    for (unsigned int i = 0; i < dimensions.width * dimensions.height; i++) {
+        bitmap[i] = 255 - bitmap[i];
+    }
 
-    APPEND_TN_META(doc, dimensions.width, dimensions.height)
-    ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) bmp_data.buf, bmp_data.cur);
+    const uint8_t *in_data[1] = {bitmap};
+    int in_line_size[1] = {(int) dimensions.width};
+
+    thumbnail_t tn;
+    if (thumbnail_encode(in_data, in_line_size, (int) dimensions.width, (int) dimensions.height, AV_PIX_FMT_GRAY8,
+                         (int) dimensions.width, (int) dimensions.height, 1.0f, 0, FALSE, &tn)) {
+        thumbnail_store(ctx->store, doc, &tn);
+    }
 
-    dyn_buffer_destroy(&bmp_data);
     free(bitmap);
 
     FT_Done_Face(face);
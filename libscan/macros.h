@@ -46,10 +46,12 @@
     if (doc->meta_head == NULL) {\
         doc->meta_head = meta;\
         doc->meta_tail = doc->meta_head;\
+        doc->meta_keys = 0;\
     } else {\
         doc->meta_tail->next = meta;\
         doc->meta_tail = meta;\
-    }
+    }\
+    doc->meta_keys |= 1ULL << meta->key;
 
 #define APPEND_UTF8_META(doc, keyname, str) \
     text_buffer_t tex = text_buffer_create(-1); \
@@ -0,0 +1,882 @@
+#include "audio_tags.h"
+#include "../util.h"
+
+// Largest tag, metadata block or Ogg packet read in one piece
+#define AUDIO_TAG_MAX_SIZE (1024 * 1024 * 16)
+#define AUDIO_OGG_PAGE_HEADER_SIZE 27
+#define AUDIO_OGG_TAIL_SIZE (1024 * 64)
+#define AUDIO_MP4_MAX_DEPTH 8
+#define AUDIO_MPEG_SEARCH_SIZE 4096
+#define ID3V1_SIZE 128
+
+const enum metakey AudioTagMetaKeys[AudioTagCount] = {
+        MetaTitle, MetaArtist, MetaAlbum, MetaAlbumArtist, MetaGenre, MetaContent,
+};
+
+static const char *Id3v1Genres[] = {
+        "Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge", "Hip-Hop", "Jazz", "Metal",
+        "New Age", "Oldies", "Other", "Pop", "R&B", "Rap", "Reggae", "Rock", "Techno", "Industrial",
+        "Alternative", "Ska", "Death Metal", "Pranks", "Soundtrack", "Euro-Techno", "Ambient", "Trip-Hop", "Vocal",
+        "Jazz+Funk", "Fusion", "Trance", "Classical", "Instrumental", "Acid", "House", "Game", "Sound Clip",
+        "Gospel", "Noise", "AlternRock", "Bass", "Soul", "Punk", "Space", "Meditative", "Instrumental Pop",
+        "Instrumental Rock", "Ethnic", "Gothic", "Darkwave", "Techno-Industrial", "Electronic", "Pop-Folk",
+        "Eurodance", "Dream", "Southern Rock", "Comedy", "Cult", "Gangsta", "Top 40", "Christian Rap", "Pop/Funk",
+        "Jungle", "Native American", "Cabaret", "New Wave", "Psychadelic", "Rave", "Showtunes", "Trailer", "Lo-Fi",
+        "Tribal", "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical", "Rock & Roll", "Hard Rock", "Folk",
+        "Folk-Rock", "National Folk", "Swing", "Fast Fusion", "Bebob", "Latin", "Revival", "Celtic", "Bluegrass",
+        "Avantgarde", "Gothic Rock", "Progressive Rock", "Psychedelic Rock", "Symphonic Rock", "Slow Rock",
+        "Big Band", "Chorus", "Easy Listening", "Acoustic", "Humour", "Speech", "Chanson", "Opera",
+        "Chamber Music", "Sonata", "Symphony", "Booty Bass", "Primus", "Porn Groove", "Satire", "Slow Jam",
+        "Club", "Tango", "Samba", "Folklore", "Ballad", "Power Ballad", "Rhythmic Soul", "Freestyle", "Duet",
+        "Punk Rock", "Drum Solo", "A capella", "Euro-House", "Dance Hall", "Goa", "Drum & Bass", "Club-House",
+        "Hardcore", "Terror", "Indie", "BritPop", "Negerpunk", "Polsk Punk", "Beat", "Christian Gangsta",
+        "Heavy Metal", "Black Metal", "Crossover", "Contemporary Christian", "Christian Rock", "Merengue",
+        "Salsa", "Thrash Metal", "Anime", "JPop", "SynthPop",
+};
+
+#define ID3V1_GENRE_COUNT ((int) (sizeof(Id3v1Genres) / sizeof(Id3v1Genres[0])))
+
+static uint32_t audio_be16(const unsigned char *p) {
+    return (uint32_t) p[0] << 8 | (uint32_t) p[1];
+}
+
+static uint32_t audio_be24(const unsigned char *p) {
+    return (uint32_t) p[0] << 16 | (uint32_t) p[1] << 8 | (uint32_t) p[2];
+}
+
+static uint32_t audio_be32(const unsigned char *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+static uint64_t audio_be64(const unsigned char *p) {
+    return (uint64_t) audio_be32(p) << 32 | audio_be32(p + 4);
+}
+
+static uint32_t audio_le16(const unsigned char *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8;
+}
+
+static uint32_t audio_le32(const unsigned char *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t audio_le64(const unsigned char *p) {
+    return (uint64_t) audio_le32(p) | (uint64_t) audio_le32(p + 4) << 32;
+}
+
+static uint32_t id3_syncsafe32(const unsigned char *p) {
+    return (uint32_t) (p[0] & 0x7F) << 21 | (uint32_t) (p[1] & 0x7F) << 14 |
+           (uint32_t) (p[2] & 0x7F) << 7 | (uint32_t) (p[3] & 0x7F);
+}
+
+static int audio_read_exact(audio_reader_t *r, void *buf, size_t len, size_t offset) {
+    if (offset > r->size || len > r->size - offset) {
+        return FALSE;
+    }
+    return r->read(r->data, buf, len, offset) == (long) len;
+}
+
+/**
+ * Read len bytes at offset in a new buffer, NULL if the read fails or is too large
+ */
+static unsigned char *audio_read_alloc(audio_reader_t *r, size_t len, size_t offset) {
+    if (len > AUDIO_TAG_MAX_SIZE) {
+        return NULL;
+    }
+    unsigned char *buf = malloc(len + 1);
+    if (!audio_read_exact(r, buf, len, offset)) {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/**
+ * Takes ownership of value. The first non-empty value of a tag is kept.
+ */
+static void audio_tags_set(audio_tags_t *tags, enum audio_tag tag, char *value) {
+    if (value == NULL) {
+        return;
+    }
+    if (tags->values[tag] != NULL || *value == '\0') {
+        free(value);
+        return;
+    }
+    tags->values[tag] = value;
+}
+
+void audio_tags_destroy(audio_tags_t *tags) {
+    for (int i = 0; i < AudioTagCount; i++) {
+        free(tags->values[i]);
+        tags->values[i] = NULL;
+    }
+}
+
+static char *audio_strndup(const unsigned char *str, size_t len) {
+    size_t n = strnlen((const char *) str, len);
+    char *dst = malloc(n + 1);
+    memcpy(dst, str, n);
+    dst[n] = '\0';
+    return dst;
+}
+
+static size_t audio_utf8_put(char *dst, uint32_t c) {
+    if (c < 0x80) {
+        dst[0] = (char) c;
+        return 1;
+    } else if (c < 0x800) {
+        dst[0] = (char) (0xC0 | c >> 6);
+        dst[1] = (char) (0x80 | (c & 0x3F));
+        return 2;
+    } else if (c < 0x10000) {
+        dst[0] = (char) (0xE0 | c >> 12);
+        dst[1] = (char) (0x80 | (c >> 6 & 0x3F));
+        dst[2] = (char) (0x80 | (c & 0x3F));
+        return 3;
+    }
+    dst[0] = (char) (0xF0 | c >> 18);
+    dst[1] = (char) (0x80 | (c >> 12 & 0x3F));
+    dst[2] = (char) (0x80 | (c >> 6 & 0x3F));
+    dst[3] = (char) (0x80 | (c & 0x3F));
+    return 4;
+}
+
+static char *audio_latin1_to_utf8(const unsigned char *str, size_t len) {
+    char *dst = malloc(len * 2 + 1);
+    size_t n = 0;
+    for (size_t i = 0; i < len && str[i] != 0; i++) {
+        n += audio_utf8_put(dst + n, str[i]);
+    }
+    dst[n] = '\0';
+    return dst;
+}
+
+static char *audio_utf16_to_utf8(const unsigned char *str, size_t len, int le) {
+    char *dst = malloc(len / 2 * 3 + 1);
+    size_t n = 0;
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        uint32_t c = le ? (str[i] | str[i + 1] << 8) : (str[i] << 8 | str[i + 1]);
+        if (c == 0) {
+            break;
+        }
+        if (c >= 0xD800 && c < 0xDC00 && i + 3 < len) {
+            uint32_t low = le ? (str[i + 2] | str[i + 3] << 8) : (str[i + 2] << 8 | str[i + 3]);
+            if (low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            }
+        }
+        n += audio_utf8_put(dst + n, c);
+    }
+    dst[n] = '\0';
+    return dst;
+}
+
+/**
+ * Right-trimmed string of a fixed-size ID3v1 field
+ */
+static char *id3v1_get_string(const unsigned char *field, size_t len) {
+    char *str = audio_latin1_to_utf8(field, len);
+    size_t n = strlen(str);
+    while (n > 0 && str[n - 1] == ' ') {
+        str[--n] = '\0';
+    }
+    return str;
+}
+
+static char *id3_genre_name(int genre) {
+    if (genre < 0 || genre >= ID3V1_GENRE_COUNT) {
+        return NULL;
+    }
+    return strdup(Id3v1Genres[genre]);
+}
+
+/**
+ * Decode a string of an ID3v2 frame to UTF-8.
+ * *consumed is set to the length of the string including its terminator
+ */
+static char *id3v2_get_string(int encoding, const unsigned char *buf, size_t len, size_t *consumed) {
+    size_t end = 0;
+    char *str;
+
+    if (encoding == 1 || encoding == 2) {
+        while (end + 1 < len && (buf[end] != 0 || buf[end + 1] != 0)) {
+            end += 2;
+        }
+        *consumed = end + 2 > len ? len : end + 2;
+
+        int le = encoding == 1;
+        size_t start = 0;
+        if (encoding == 1 && end >= 2) {
+            if (buf[0] == 0xFE && buf[1] == 0xFF) {
+                le = FALSE;
+                start = 2;
+            } else if (buf[0] == 0xFF && buf[1] == 0xFE) {
+                start = 2;
+            }
+        }
+        str = audio_utf16_to_utf8(buf + start, end - start, le);
+    } else {
+        while (end < len && buf[end] != 0) {
+            end += 1;
+        }
+        *consumed = end + 1 > len ? len : end + 1;
+        str = encoding == 3 ? audio_strndup(buf, end) : audio_latin1_to_utf8(buf, end);
+    }
+    return str;
+}
+
+static void id3v2_read_text(audio_tags_t *tags, enum audio_tag tag, const unsigned char *data, size_t len) {
+    if (len < 2) {
+        return;
+    }
+    size_t consumed;
+    char *value = id3v2_get_string(data[0], data + 1, len - 1, &consumed);
+
+    // Numeric genres, either "(13)" or "13"
+    int genre;
+    if (tag == AudioTagGenre && (sscanf(value, "(%d)", &genre) == 1 || sscanf(value, "%d", &genre) == 1)) {
+        char *name = id3_genre_name(genre);
+        if (name != NULL) {
+            free(value);
+            value = name;
+        }
+    }
+    audio_tags_set(tags, tag, value);
+}
+
+static void id3v2_read_comment(audio_tags_t *tags, const unsigned char *data, size_t len) {
+    // Encoding, language, description, text
+    if (len < 5) {
+        return;
+    }
+    size_t consumed;
+    char *description = id3v2_get_string(data[0], data + 4, len - 4, &consumed);
+    int has_description = *description != '\0';
+    free(description);
+
+    // ffmpeg names the comments with a description "comment-<description>"
+    if (has_description) {
+        return;
+    }
+    size_t text_consumed;
+    audio_tags_set(tags, AudioTagComment, id3v2_get_string(data[0], data + 4 + consumed, len - 4 - consumed,
+                                                           &text_consumed));
+}
+
+typedef struct {
+    const char *id;
+    const char *id_v22;
+    enum audio_tag tag;
+} id3v2_text_frame_t;
+
+static const id3v2_text_frame_t Id3v2TextFrames[] = {
+        {"TIT2", "TT2", AudioTagTitle},
+        {"TPE1", "TP1", AudioTagArtist},
+        {"TALB", "TAL", AudioTagAlbum},
+        {"TPE2", "TP2", AudioTagAlbumArtist},
+        {"TCON", "TCO", AudioTagGenre},
+};
+
+static void id3v2_read_frame(audio_tags_t *tags, int version, const char *id, const unsigned char *data, size_t len) {
+    for (int i = 0; i < sizeof(Id3v2TextFrames) / sizeof(Id3v2TextFrames[0]); i++) {
+        if (strcmp(id, version == 2 ? Id3v2TextFrames[i].id_v22 : Id3v2TextFrames[i].id) == 0) {
+            id3v2_read_text(tags, Id3v2TextFrames[i].tag, data, len);
+            return;
+        }
+    }
+
+    if (strcmp(id, version == 2 ? "COM" : "COMM") == 0) {
+        id3v2_read_comment(tags, data, len);
+    } else if (strcmp(id, version == 2 ? "PIC" : "APIC") == 0) {
+        tags->has_picture = TRUE;
+    } else if (strcmp(id, version == 2 ? "TLE" : "TLEN") == 0 && len > 1 && tags->duration == 0) {
+        size_t consumed;
+        char *value = id3v2_get_string(data[0], data + 1, len - 1, &consumed);
+        tags->duration = strtol(value, NULL, 10) / 1000;
+        free(value);
+    }
+}
+
+/**
+ * Read the ID3v2 tag at the start of the file
+ *
+ * @param tag_size set to the size of the tag, including its header
+ * @return FALSE if there is no tag or it cannot be read without ffmpeg
+ */
+static int id3v2_read(audio_reader_t *r, audio_tags_t *tags, size_t *tag_size) {
+    unsigned char header[10];
+    if (!audio_read_exact(r, header, sizeof(header), 0) || memcmp(header, "ID3", 3) != 0) {
+        return FALSE;
+    }
+
+    int version = header[3];
+    int flags = header[5];
+    size_t size = id3_syncsafe32(header + 6);
+
+    *tag_size = size + 10 + ((version == 4 && flags & 0x10) ? 10 : 0);
+
+    // Unsynchronised tags are rare enough to be left to ffmpeg
+    if (version < 2 || version > 4 || (flags & 0x80 && version < 4)) {
+        return FALSE;
+    }
+
+    unsigned char *body = audio_read_alloc(r, size, 10);
+    if (body == NULL) {
+        return FALSE;
+    }
+
+    size_t pos = 0;
+    if (flags & 0x40 && version > 2 && size >= 4) {
+        pos = version == 3 ? audio_be32(body) + 4 : id3_syncsafe32(body);
+    }
+
+    size_t header_size = version == 2 ? 6 : 10;
+    while (pos + header_size <= size && body[pos] != 0) {
+        char id[5] = {0};
+        size_t frame_size;
+        int frame_flags = 0;
+
+        if (version == 2) {
+            memcpy(id, body + pos, 3);
+            frame_size = audio_be24(body + pos + 3);
+        } else {
+            memcpy(id, body + pos, 4);
+            frame_size = version == 3 ? audio_be32(body + pos + 4) : id3_syncsafe32(body + pos + 4);
+            frame_flags = body[pos + 9];
+        }
+
+        if (frame_size > size - pos - header_size) {
+            break;
+        }
+
+        const unsigned char *data = body + pos + header_size;
+        size_t data_len = frame_size;
+        int skip = FALSE;
+
+        if (version == 3) {
+            // Compressed or encrypted
+            skip = (frame_flags & 0xC0) != 0;
+        } else if (version == 4) {
+            // Compressed, encrypted or unsynchronised
+            skip = (frame_flags & 0x0E) != 0;
+            if (frame_flags & 0x01 && data_len >= 4) {
+                data += 4;
+                data_len -= 4;
+            }
+        }
+
+        if (!skip) {
+            id3v2_read_frame(tags, version, id, data, data_len);
+        }
+        pos += header_size + frame_size;
+    }
+
+    free(body);
+    return TRUE;
+}
+
+/**
+ * Read the ID3v1 tag at the end of the file, values already set by ID3v2 are kept
+ */
+static int id3v1_read(audio_reader_t *r, audio_tags_t *tags) {
+    unsigned char tag[ID3V1_SIZE];
+    if (r->size < ID3V1_SIZE || !audio_read_exact(r, tag, ID3V1_SIZE, r->size - ID3V1_SIZE)
+        || memcmp(tag, "TAG", 3) != 0) {
+        return FALSE;
+    }
+
+    audio_tags_set(tags, AudioTagTitle, id3v1_get_string(tag + 3, 30));
+    audio_tags_set(tags, AudioTagArtist, id3v1_get_string(tag + 33, 30));
+    audio_tags_set(tags, AudioTagAlbum, id3v1_get_string(tag + 63, 30));
+    // ID3v1.1 stores the track number in the last 2 bytes of the comment
+    audio_tags_set(tags, AudioTagComment, id3v1_get_string(tag + 97, tag[125] == 0 ? 28 : 30));
+    audio_tags_set(tags, AudioTagGenre, id3_genre_name(tag[127]));
+    return TRUE;
+}
+
+static const int MpegBitrates[2][3][15] = {
+        {
+                // MPEG-1 layer I, II, III
+                {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+                {0, 32, 48, 56, 64,  80,  96,  112, 128, 160, 192, 224, 256, 320, 384},
+                {0, 32, 40, 48, 56,  64,  80,  96,  112, 128, 160, 192, 224, 256, 320},
+        },
+        {
+                // MPEG-2/2.5 layer I, II, III
+                {0, 32, 48, 56, 64,  80,  96,  112, 128, 144, 160, 176, 192, 224, 256},
+                {0, 8,  16, 24, 32,  40,  48,  56,  64,  80,  96,  112, 128, 144, 160},
+                {0, 8,  16, 24, 32,  40,  48,  56,  64,  80,  96,  112, 128, 144, 160},
+        },
+};
+
+static const int MpegSampleRates[3] = {44100, 48000, 32000};
+
+/**
+ * Approximate duration of an MPEG audio stream from its first frame: exact when
+ * the frame has a Xing/Info or VBRI header, from the bitrate otherwise.
+ *
+ * @param offset start of the audio data
+ * @param end end of the audio data
+ */
+static int mpeg_audio_read(audio_reader_t *r, size_t offset, size_t end, audio_tags_t *tags) {
+    unsigned char buf[AUDIO_MPEG_SEARCH_SIZE];
+    size_t len = end - offset < sizeof(buf) ? end - offset : sizeof(buf);
+    if (end <= offset || !audio_read_exact(r, buf, len, offset)) {
+        return FALSE;
+    }
+
+    // Skip the padding between the tag and the first frame
+    size_t pos = 0;
+    while (pos + 4 <= len && !(buf[pos] == 0xFF && (buf[pos + 1] & 0xE0) == 0xE0)) {
+        pos += 1;
+    }
+    if (pos + 4 > len) {
+        return FALSE;
+    }
+
+    int version = buf[pos + 1] >> 3 & 3;
+    int layer = buf[pos + 1] >> 1 & 3;
+    int bitrate_index = buf[pos + 2] >> 4;
+    int rate_index = buf[pos + 2] >> 2 & 3;
+    int mono = (buf[pos + 3] >> 6) == 3;
+
+    if (version == 1 || layer == 0 || bitrate_index == 15 || rate_index == 3) {
+        return FALSE;
+    }
+
+    int mpeg1 = version == 3;
+    int sample_rate = MpegSampleRates[rate_index] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+    int bitrate = MpegBitrates[mpeg1 ? 0 : 1][3 - layer][bitrate_index];
+    int samples_per_frame = layer == 3 ? 384 : (layer == 1 && !mpeg1) ? 576 : 1152;
+
+    tags->codec = layer == 1 ? "mp3" : layer == 2 ? "mp2" : "mp1";
+
+    long frames = 0;
+    size_t xing = pos + 4 + (mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+    size_t vbri = pos + 4 + 32;
+    if (xing + 12 <= len && (memcmp(buf + xing, "Xing", 4) == 0 || memcmp(buf + xing, "Info", 4) == 0)
+        && audio_be32(buf + xing + 4) & 1) {
+        frames = audio_be32(buf + xing + 8);
+    } else if (vbri + 18 <= len && memcmp(buf + vbri, "VBRI", 4) == 0) {
+        frames = audio_be32(buf + vbri + 14);
+    }
+
+    if (frames > 0) {
+        tags->duration = (long) ((double) frames * samples_per_frame / sample_rate);
+    } else if (bitrate > 0 && tags->duration == 0) {
+        tags->duration = (long) ((end - offset - pos) * 8 / ((size_t) bitrate * 1000));
+    }
+    return TRUE;
+}
+
+static void vorbis_comment_read(audio_tags_t *tags, const unsigned char *buf, size_t len) {
+    if (len < 8) {
+        return;
+    }
+    size_t pos = 4 + (size_t) audio_le32(buf);
+    if (pos + 4 > len) {
+        return;
+    }
+    uint32_t count = audio_le32(buf + pos);
+    pos += 4;
+
+    for (uint32_t i = 0; i < count && pos + 4 <= len; i++) {
+        size_t comment_len = audio_le32(buf + pos);
+        pos += 4;
+        if (comment_len > len - pos) {
+            break;
+        }
+
+        const char *comment = (const char *) buf + pos;
+        const char *sep = memchr(comment, '=', comment_len);
+        pos += comment_len;
+        if (sep == NULL) {
+            continue;
+        }
+
+        size_t key_len = sep - comment;
+        const unsigned char *value = (const unsigned char *) sep + 1;
+        size_t value_len = comment_len - key_len - 1;
+
+#define VORBIS_KEY_IS(key) (key_len == sizeof(key) - 1 && strncasecmp(comment, key, key_len) == 0)
+        if (VORBIS_KEY_IS("TITLE")) {
+            audio_tags_set(tags, AudioTagTitle, audio_strndup(value, value_len));
+        } else if (VORBIS_KEY_IS("ARTIST")) {
+            audio_tags_set(tags, AudioTagArtist, audio_strndup(value, value_len));
+        } else if (VORBIS_KEY_IS("ALBUM")) {
+            audio_tags_set(tags, AudioTagAlbum, audio_strndup(value, value_len));
+        } else if (VORBIS_KEY_IS("ALBUMARTIST") || VORBIS_KEY_IS("ALBUM_ARTIST")) {
+            audio_tags_set(tags, AudioTagAlbumArtist, audio_strndup(value, value_len));
+        } else if (VORBIS_KEY_IS("GENRE")) {
+            audio_tags_set(tags, AudioTagGenre, audio_strndup(value, value_len));
+        } else if (VORBIS_KEY_IS("COMMENT") || VORBIS_KEY_IS("DESCRIPTION")) {
+            audio_tags_set(tags, AudioTagComment, audio_strndup(value, value_len));
+        } else if (VORBIS_KEY_IS("METADATA_BLOCK_PICTURE")) {
+            tags->has_picture = TRUE;
+        }
+#undef VORBIS_KEY_IS
+    }
+}
+
+static int flac_read(audio_reader_t *r, size_t offset, audio_tags_t *tags) {
+    unsigned char header[4];
+    if (!audio_read_exact(r, header, 4, offset) || memcmp(header, "fLaC", 4) != 0) {
+        return FALSE;
+    }
+    tags->codec = "flac";
+
+    size_t pos = offset + 4;
+    int last = FALSE;
+    while (!last && audio_read_exact(r, header, 4, pos)) {
+        last = header[0] & 0x80;
+        int type = header[0] & 0x7F;
+        size_t len = audio_be24(header + 1);
+
+        if (type == 0 && len >= 18) {
+            // STREAMINFO
+            unsigned char info[18];
+            if (audio_read_exact(r, info, sizeof(info), pos + 4)) {
+                uint32_t sample_rate = info[10] << 12 | info[11] << 4 | info[12] >> 4;
+                uint64_t samples = (uint64_t) (info[13] & 0x0F) << 32 | audio_be32(info + 14);
+                if (sample_rate > 0) {
+                    tags->duration = (long) (samples / sample_rate);
+                }
+            }
+        } else if (type == 4) {
+            // VORBIS_COMMENT, skipped as a whole if it is too large
+            unsigned char *comment = audio_read_alloc(r, len, pos + 4);
+            if (comment != NULL) {
+                vorbis_comment_read(tags, comment, len);
+                free(comment);
+            }
+        } else if (type == 6) {
+            // PICTURE
+            tags->has_picture = TRUE;
+        }
+        pos += 4 + len;
+    }
+    return TRUE;
+}
+
+/**
+ * Reassemble the first packets of the first logical stream of an Ogg file
+ *
+ * @param next_page set to the offset of the page after the last packet
+ * @return number of packets read
+ */
+static int ogg_read_packets(audio_reader_t *r, dyn_buffer_t *packets, size_t *packet_ends, int count,
+                            uint32_t *serial, size_t *next_page) {
+    unsigned char header[AUDIO_OGG_PAGE_HEADER_SIZE + 255];
+    size_t pos = 0;
+    int packet = 0;
+    int first = TRUE;
+
+    while (packet < count && audio_read_exact(r, header, AUDIO_OGG_PAGE_HEADER_SIZE, pos)) {
+        if (memcmp(header, "OggS", 4) != 0 || header[4] != 0) {
+            break;
+        }
+        int segments = header[26];
+        if (!audio_read_exact(r, header + AUDIO_OGG_PAGE_HEADER_SIZE, segments, pos + AUDIO_OGG_PAGE_HEADER_SIZE)) {
+            break;
+        }
+        if (first) {
+            *serial = audio_le32(header + 14);
+            first = FALSE;
+        }
+
+        size_t body_len = 0;
+        for (int i = 0; i < segments; i++) {
+            body_len += header[AUDIO_OGG_PAGE_HEADER_SIZE + i];
+        }
+        size_t body = pos + AUDIO_OGG_PAGE_HEADER_SIZE + segments;
+        pos = body + body_len;
+
+        // Pages of other streams
+        if (audio_le32(header + 14) != *serial) {
+            continue;
+        }
+        if (packets->cur + body_len > AUDIO_TAG_MAX_SIZE) {
+            break;
+        }
+
+        unsigned char *data = audio_read_alloc(r, body_len, body);
+        if (data == NULL) {
+            break;
+        }
+        size_t offset = 0;
+        for (int i = 0; i < segments && packet < count; i++) {
+            int lacing = header[AUDIO_OGG_PAGE_HEADER_SIZE + i];
+            dyn_buffer_write(packets, data + offset, lacing);
+            offset += lacing;
+            if (lacing < 255) {
+                packet_ends[packet++] = packets->cur;
+            }
+        }
+        free(data);
+    }
+
+    *next_page = pos;
+    return packet;
+}
+
+/**
+ * Granule position of the last page of the stream, -1 if not found
+ */
+static int64_t ogg_last_granule(audio_reader_t *r, uint32_t serial) {
+    size_t len = r->size < AUDIO_OGG_TAIL_SIZE ? r->size : AUDIO_OGG_TAIL_SIZE;
+    unsigned char *buf = audio_read_alloc(r, len, r->size - len);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    int64_t granule = -1;
+    for (size_t i = len >= AUDIO_OGG_PAGE_HEADER_SIZE ? len - AUDIO_OGG_PAGE_HEADER_SIZE + 1 : 0; i-- > 0;) {
+        if (memcmp(buf + i, "OggS", 4) == 0 && buf[i + 4] == 0 && audio_le32(buf + i + 14) == serial) {
+            granule = (int64_t) audio_le64(buf + i + 6);
+            break;
+        }
+    }
+    free(buf);
+    return granule;
+}
+
+static int ogg_read(audio_reader_t *r, audio_tags_t *tags) {
+    dyn_buffer_t packets = dyn_buffer_create();
+    size_t packet_ends[2];
+    uint32_t serial;
+    size_t next_page;
+
+    if (ogg_read_packets(r, &packets, packet_ends, 2, &serial, &next_page) != 2) {
+        dyn_buffer_destroy(&packets);
+        return FALSE;
+    }
+
+    const unsigned char *id = (unsigned char *) packets.buf;
+    size_t id_len = packet_ends[0];
+    const unsigned char *comment = (unsigned char *) packets.buf + packet_ends[0];
+    size_t comment_len = packet_ends[1] - packet_ends[0];
+
+    uint32_t sample_rate;
+    uint32_t pre_skip = 0;
+    if (id_len >= 16 && memcmp(id, "\x01vorbis", 7) == 0
+        && comment_len >= 7 && memcmp(comment, "\x03vorbis", 7) == 0) {
+        tags->codec = "vorbis";
+        sample_rate = audio_le32(id + 12);
+        vorbis_comment_read(tags, comment + 7, comment_len - 7);
+    } else if (id_len >= 19 && memcmp(id, "OpusHead", 8) == 0
+               && comment_len >= 8 && memcmp(comment, "OpusTags", 8) == 0) {
+        tags->codec = "opus";
+        sample_rate = 48000;
+        pre_skip = audio_le16(id + 10);
+        vorbis_comment_read(tags, comment + 8, comment_len - 8);
+    } else {
+        // Ogg FLAC, Speex, Theora...
+        dyn_buffer_destroy(&packets);
+        return FALSE;
+    }
+    dyn_buffer_destroy(&packets);
+
+    int64_t granule = ogg_last_granule(r, serial);
+    if (granule > pre_skip && sample_rate > 0) {
+        tags->duration = (long) ((granule - pre_skip) / sample_rate);
+    }
+    return TRUE;
+}
+
+/**
+ * Find the first child atom of this type in [start, end[
+ *
+ * @param body_start set to the offset of the atom's payload
+ * @param body_end set to the end of the atom
+ */
+static int mp4_find_atom(audio_reader_t *r, size_t start, size_t end, const char *type,
+                         size_t *body_start, size_t *body_end) {
+    unsigned char header[16];
+    size_t pos = start;
+
+    while (pos + 8 <= end && audio_read_exact(r, header, 8, pos)) {
+        uint64_t size = audio_be32(header);
+        size_t header_size = 8;
+        if (size == 1) {
+            if (pos + 16 > end || !audio_read_exact(r, header + 8, 8, pos + 8)) {
+                return FALSE;
+            }
+            size = audio_be64(header + 8);
+            header_size = 16;
+        } else if (size == 0) {
+            size = end - pos;
+        }
+        if (size < header_size || size > end - pos) {
+            return FALSE;
+        }
+
+        if (memcmp(header + 4, type, 4) == 0) {
+            *body_start = pos + header_size;
+            *body_end = pos + size;
+            return TRUE;
+        }
+        pos += size;
+    }
+    return FALSE;
+}
+
+/**
+ * Find an atom from a path of 4-character types, e.g. "moovudta"
+ */
+static int mp4_find_path(audio_reader_t *r, size_t start, size_t end, const char *path,
+                         size_t *body_start, size_t *body_end) {
+    size_t depth = strlen(path) / 4;
+    if (depth > AUDIO_MP4_MAX_DEPTH) {
+        return FALSE;
+    }
+    for (size_t i = 0; i < depth; i++) {
+        if (!mp4_find_atom(r, start, end, path + i * 4, &start, &end)) {
+            return FALSE;
+        }
+    }
+    *body_start = start;
+    *body_end = end;
+    return TRUE;
+}
+
+typedef struct {
+    const char *type;
+    enum audio_tag tag;
+} mp4_text_atom_t;
+
+static const mp4_text_atom_t Mp4TextAtoms[] = {
+        {"\xA9nam", AudioTagTitle},
+        {"\xA9" "ART", AudioTagArtist},
+        {"\xA9" "alb", AudioTagAlbum},
+        {"aART", AudioTagAlbumArtist},
+        {"\xA9gen", AudioTagGenre},
+        {"\xA9" "cmt", AudioTagComment},
+};
+
+static void mp4_read_ilst(audio_reader_t *r, size_t start, size_t end, audio_tags_t *tags) {
+    unsigned char header[8];
+    size_t pos = start;
+
+    while (pos + 8 <= end && audio_read_exact(r, header, 8, pos)) {
+        size_t size = audio_be32(header);
+        if (size < 8 || size > end - pos) {
+            return;
+        }
+
+        size_t data_start, data_end;
+        if (memcmp(header + 4, "covr", 4) == 0) {
+            tags->has_picture = TRUE;
+        } else if (mp4_find_atom(r, pos + 8, pos + size, "data", &data_start, &data_end)
+                   && data_end - data_start >= 8) {
+            // Type and locale
+            data_start += 8;
+            unsigned char *value = audio_read_alloc(r, data_end - data_start, data_start);
+
+            if (value != NULL) {
+                size_t len = data_end - data_start;
+                if (memcmp(header + 4, "gnre", 4) == 0 && len >= 2) {
+                    audio_tags_set(tags, AudioTagGenre, id3_genre_name((int) audio_be16(value) - 1));
+                }
+                for (int i = 0; i < sizeof(Mp4TextAtoms) / sizeof(Mp4TextAtoms[0]); i++) {
+                    if (memcmp(header + 4, Mp4TextAtoms[i].type, 4) == 0) {
+                        audio_tags_set(tags, Mp4TextAtoms[i].tag, audio_strndup(value, len));
+                        break;
+                    }
+                }
+                free(value);
+            }
+        }
+        pos += size;
+    }
+}
+
+static int mp4_read(audio_reader_t *r, audio_tags_t *tags) {
+    unsigned char buf[32];
+    if (!audio_read_exact(r, buf, 8, 0) || memcmp(buf + 4, "ftyp", 4) != 0) {
+        return FALSE;
+    }
+
+    size_t moov_start, moov_end;
+    if (!mp4_find_atom(r, 0, r->size, "moov", &moov_start, &moov_end)) {
+        return FALSE;
+    }
+
+    // Codec of the first track
+    size_t start, end;
+    if (!mp4_find_path(r, moov_start, moov_end, "trakmdiaminfstblstsd", &start, &end)
+        || end - start < 16 || !audio_read_exact(r, buf, 16, start)) {
+        return FALSE;
+    }
+    if (memcmp(buf + 12, "mp4a", 4) == 0) {
+        tags->codec = "aac";
+    } else if (memcmp(buf + 12, "alac", 4) == 0) {
+        tags->codec = "alac";
+    } else {
+        return FALSE;
+    }
+
+    if (mp4_find_atom(r, moov_start, moov_end, "mvhd", &start, &end)
+        && end - start >= 32 && audio_read_exact(r, buf, 32, start)) {
+        uint32_t timescale = buf[0] == 1 ? audio_be32(buf + 20) : audio_be32(buf + 12);
+        uint64_t duration = buf[0] == 1 ? audio_be64(buf + 24) : audio_be32(buf + 16);
+        if (timescale > 0) {
+            tags->duration = (long) (duration / timescale);
+        }
+    }
+
+    if (mp4_find_path(r, moov_start, moov_end, "udtameta", &start, &end) && end - start >= 8
+        && audio_read_exact(r, buf, 8, start)) {
+        // meta is a full box, except in some QuickTime files
+        if (memcmp(buf + 4, "hdlr", 4) != 0) {
+            start += 4;
+        }
+        if (mp4_find_atom(r, start, end, "ilst", &start, &end)) {
+            mp4_read_ilst(r, start, end, tags);
+        }
+    }
+    return TRUE;
+}
+
+int audio_tags_read(audio_reader_t *r, audio_tags_t *tags) {
+    memset(tags, 0, sizeof(audio_tags_t));
+
+    unsigned char magic[4];
+    if (!audio_read_exact(r, magic, 4, 0)) {
+        return FALSE;
+    }
+
+    if (memcmp(magic, "OggS", 4) == 0) {
+        return ogg_read(r, tags);
+    }
+    if (memcmp(magic, "fLaC", 4) == 0) {
+        return flac_read(r, 0, tags);
+    }
+    if (mp4_read(r, tags)) {
+        return TRUE;
+    }
+    if (memcmp(magic, "ID3", 3) != 0 && !(magic[0] == 0xFF && (magic[1] & 0xE0) == 0xE0)) {
+        return FALSE;
+    }
+
+    size_t tag_size = 0;
+    if (memcmp(magic, "ID3", 3) == 0 && !id3v2_read(r, tags, &tag_size)) {
+        audio_tags_destroy(tags);
+        return FALSE;
+    }
+
+    // FLAC files can also start with an ID3v2 tag
+    if (flac_read(r, tag_size, tags)) {
+        return TRUE;
+    }
+
+    size_t end = r->size;
+    if (id3v1_read(r, tags)) {
+        end -= ID3V1_SIZE;
+    }
+    if (!mpeg_audio_read(r, tag_size, end, tags)) {
+        audio_tags_destroy(tags);
+        return FALSE;
+    }
+    return TRUE;
+}
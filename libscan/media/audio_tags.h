@@ -0,0 +1,57 @@
+#ifndef SCAN_AUDIO_TAGS_H
+#define SCAN_AUDIO_TAGS_H
+
+#include "../scan.h"
+
+#include <stdint.h>
+
+/*
+ * Minimal ID3v1/ID3v2, FLAC, Ogg (Vorbis/Opus) and MP4 tag reader that only
+ * reads the headers of the file, so that the common audio tags and an
+ * approximate duration can be read without opening the file with ffmpeg.
+ * Tags are mapped the same way as ffmpeg's metadata conversion tables.
+ */
+
+enum audio_tag {
+    AudioTagTitle,
+    AudioTagArtist,
+    AudioTagAlbum,
+    AudioTagAlbumArtist,
+    AudioTagGenre,
+    AudioTagComment,
+    AudioTagCount,
+};
+
+// Metadata key of each audio_tag
+extern const enum metakey AudioTagMetaKeys[AudioTagCount];
+
+/**
+ * Reads len bytes at offset, returns the number of bytes read
+ */
+typedef long (*audio_read_callback_t)(void *data, void *buf, size_t len, size_t offset);
+
+typedef struct {
+    audio_read_callback_t read;
+    void *data;
+    size_t size;
+} audio_reader_t;
+
+typedef struct {
+    char *values[AudioTagCount];
+    // Same name as the ffmpeg codec descriptor
+    const char *codec;
+    // In seconds, 0 if unknown
+    long duration;
+    int has_picture;
+} audio_tags_t;
+
+/**
+ * Read the tags of an MP3, FLAC, Ogg Vorbis/Opus or MP4 audio file
+ *
+ * @return FALSE if the format is not supported, the file must then be read with ffmpeg
+ */
+int audio_tags_read(audio_reader_t *r, audio_tags_t *tags);
+
+void audio_tags_destroy(audio_tags_t *tags);
+
+#endif
@@ -0,0 +1,689 @@
+#ifndef SCAN_EXIF_H
+#define SCAN_EXIF_H
+
+#include "../scan.h"
+#include "../util.h"
+
+#include <stdint.h>
+
+/*
+ * Minimal TIFF/EXIF and XMP reader working on an in-memory buffer, so that
+ * metadata and the embedded thumbnail can be read without decoding the image.
+ * Values are formatted the same way as ffmpeg's tiff_common.c.
+ */
+
+#define TIFF_BYTE 1
+#define TIFF_STRING 2
+#define TIFF_SHORT 3
+#define TIFF_LONG 4
+#define TIFF_RATIONAL 5
+#define TIFF_SBYTE 6
+#define TIFF_UNDEFINED 7
+#define TIFF_SSHORT 8
+#define TIFF_SLONG 9
+#define TIFF_SRATIONAL 10
+#define TIFF_FLOAT 11
+#define TIFF_DOUBLE 12
+
+#define TIFF_TAG_WIDTH 0x0100
+#define TIFF_TAG_HEIGHT 0x0101
+#define TIFF_TAG_JPEG_OFFSET 0x0201
+#define TIFF_TAG_JPEG_LENGTH 0x0202
+#define TIFF_TAG_XMP 0x02BC
+#define TIFF_TAG_EXIF_IFD 0x8769
+#define TIFF_TAG_GPS_IFD 0x8825
+#define TIFF_TAG_INTEROP_IFD 0xA005
+
+#define GPS_TAG_LATITUDE_REF 0x0001
+#define GPS_TAG_LATITUDE 0x0002
+#define GPS_TAG_LONGITUDE_REF 0x0003
+#define GPS_TAG_LONGITUDE 0x0004
+
+#define EXIF_MAX_DEPTH 2
+#define EXIF_MAX_ENTRIES 512
+
+enum exif_ifd {
+    ExifIfdMain,
+    ExifIfdExif,
+    ExifIfdGps,
+    ExifIfdInterop,
+};
+
+typedef struct {
+    const unsigned char *buf;
+    size_t len;
+    int le;
+    // Offset of IFD0
+    uint32_t ifd0;
+} tiff_t;
+
+typedef struct {
+    uint16_t tag;
+    uint16_t type;
+    uint32_t count;
+    // Offset of the value from the start of the TIFF header
+    size_t offset;
+} tiff_entry_t;
+
+typedef void (*tiff_entry_cb_t)(void *data, const tiff_t *tiff, enum exif_ifd ifd, const tiff_entry_t *entry);
+
+static uint16_t tiff_get_u16(const tiff_t *tiff, size_t offset) {
+    const unsigned char *p = tiff->buf + offset;
+    return tiff->le ? (uint16_t) (p[0] | p[1] << 8) : (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static uint32_t tiff_get_u32(const tiff_t *tiff, size_t offset) {
+    const unsigned char *p = tiff->buf + offset;
+    return tiff->le
+           ? (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24
+           : (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+static int tiff_init(tiff_t *tiff, const unsigned char *buf, size_t len) {
+    if (len < 8) {
+        return FALSE;
+    }
+
+    if (buf[0] == 'I' && buf[1] == 'I') {
+        tiff->le = TRUE;
+    } else if (buf[0] == 'M' && buf[1] == 'M') {
+        tiff->le = FALSE;
+    } else {
+        return FALSE;
+    }
+
+    tiff->buf = buf;
+    tiff->len = len;
+
+    if (tiff_get_u16(tiff, 2) != 42) {
+        return FALSE;
+    }
+    tiff->ifd0 = tiff_get_u32(tiff, 4);
+    return tiff->ifd0 >= 8 && tiff->ifd0 < len;
+}
+
+static size_t tiff_type_size(uint16_t type) {
+    switch (type) {
+        case TIFF_BYTE:
+        case TIFF_STRING:
+        case TIFF_SBYTE:
+        case TIFF_UNDEFINED:
+            return 1;
+        case TIFF_SHORT:
+        case TIFF_SSHORT:
+            return 2;
+        case TIFF_LONG:
+        case TIFF_SLONG:
+        case TIFF_FLOAT:
+            return 4;
+        case TIFF_RATIONAL:
+        case TIFF_SRATIONAL:
+        case TIFF_DOUBLE:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+/*
+ * Returns FALSE if the entry's value is not entirely inside the buffer
+ */
+static int tiff_read_entry(const tiff_t *tiff, size_t entry_offset, tiff_entry_t *entry) {
+    entry->tag = tiff_get_u16(tiff, entry_offset);
+    entry->type = tiff_get_u16(tiff, entry_offset + 2);
+    entry->count = tiff_get_u32(tiff, entry_offset + 4);
+
+    size_t type_size = tiff_type_size(entry->type);
+    if (type_size == 0 || entry->count > tiff->len / type_size) {
+        return FALSE;
+    }
+
+    size_t size = type_size * entry->count;
+    entry->offset = size <= 4 ? entry_offset + 8 : tiff_get_u32(tiff, entry_offset + 8);
+
+    return entry->offset <= tiff->len && size <= tiff->len - entry->offset;
+}
+
+/*
+ * Calls cb for every entry of the IFD and of its EXIF/GPS/Interop sub-IFDs.
+ * Returns the offset of the next IFD, or 0
+ */
+static uint32_t tiff_walk_ifd(const tiff_t *tiff, uint32_t offset, enum exif_ifd ifd, int depth,
+                              tiff_entry_cb_t cb, void *data) {
+
+    if (offset < 8 || (size_t) offset + 2 > tiff->len) {
+        return 0;
+    }
+
+    int count = tiff_get_u16(tiff, offset);
+    if (count > EXIF_MAX_ENTRIES || (size_t) offset + 2 + count * 12 + 4 > tiff->len) {
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        tiff_entry_t entry;
+        if (!tiff_read_entry(tiff, offset + 2 + i * 12, &entry)) {
+            continue;
+        }
+
+        if ((entry.tag == TIFF_TAG_EXIF_IFD || entry.tag == TIFF_TAG_GPS_IFD || entry.tag == TIFF_TAG_INTEROP_IFD)
+            && (entry.type == TIFF_LONG || entry.type == 13) && depth < EXIF_MAX_DEPTH) {
+
+            enum exif_ifd sub_ifd = entry.tag == TIFF_TAG_EXIF_IFD ? ExifIfdExif
+                                    : entry.tag == TIFF_TAG_GPS_IFD ? ExifIfdGps
+                                    : ExifIfdInterop;
+            uint32_t sub_offset = tiff_get_u32(tiff, entry.offset);
+            if (sub_offset != offset) {
+                tiff_walk_ifd(tiff, sub_offset, sub_ifd, depth + 1, cb, data);
+            }
+            continue;
+        }
+
+        cb(data, tiff, ifd, &entry);
+    }
+
+    return tiff_get_u32(tiff, offset + 2 + count * 12);
+}
+
+static long tiff_get_int(const tiff_t *tiff, const tiff_entry_t *entry) {
+    switch (entry->type) {
+        case TIFF_BYTE:
+        case TIFF_UNDEFINED:
+            return tiff->buf[entry->offset];
+        case TIFF_SBYTE:
+            return (int8_t) tiff->buf[entry->offset];
+        case TIFF_SHORT:
+            return tiff_get_u16(tiff, entry->offset);
+        case TIFF_SSHORT:
+            return (int16_t) tiff_get_u16(tiff, entry->offset);
+        case TIFF_LONG:
+            return tiff_get_u32(tiff, entry->offset);
+        case TIFF_SLONG:
+            return (int32_t) tiff_get_u32(tiff, entry->offset);
+        default:
+            return 0;
+    }
+}
+
+static double tiff_get_double(const tiff_t *tiff, size_t offset) {
+    uint64_t bits = tiff->le
+                    ? (uint64_t) tiff_get_u32(tiff, offset + 4) << 32 | tiff_get_u32(tiff, offset)
+                    : (uint64_t) tiff_get_u32(tiff, offset) << 32 | tiff_get_u32(tiff, offset + 4);
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+static const char *tiff_auto_sep(uint32_t count, uint32_t i, uint32_t columns) {
+    if (i && i % columns) {
+        return ", ";
+    }
+    return columns < count ? "\n" : "";
+}
+
+/*
+ * Format the value of an entry as a null-terminated string in out
+ */
+static void tiff_format_value(const tiff_t *tiff, const tiff_entry_t *entry, dyn_buffer_t *out) {
+    char tmp[64];
+    const unsigned char *p = tiff->buf + entry->offset;
+
+    switch (entry->type) {
+        case TIFF_STRING:
+            dyn_buffer_write(out, p, strnlen((const char *) p, entry->count));
+            break;
+        case TIFF_BYTE:
+        case TIFF_SBYTE:
+        case TIFF_UNDEFINED:
+            for (uint32_t i = 0; i < entry->count; i++) {
+                int v = entry->type == TIFF_SBYTE ? (int8_t) p[i] : p[i];
+                snprintf(tmp, sizeof(tmp), "%s%3i", tiff_auto_sep(entry->count, i, 16), v);
+                dyn_buffer_append_string(out, tmp);
+            }
+            break;
+        case TIFF_SHORT:
+        case TIFF_SSHORT:
+            for (uint32_t i = 0; i < entry->count; i++) {
+                uint16_t v = tiff_get_u16(tiff, entry->offset + i * 2);
+                snprintf(tmp, sizeof(tmp), "%s%5i", tiff_auto_sep(entry->count, i, 8),
+                         entry->type == TIFF_SSHORT ? (int) (int16_t) v : (int) v);
+                dyn_buffer_append_string(out, tmp);
+            }
+            break;
+        case TIFF_LONG:
+        case TIFF_SLONG:
+            for (uint32_t i = 0; i < entry->count; i++) {
+                snprintf(tmp, sizeof(tmp), "%s%7i", tiff_auto_sep(entry->count, i, 8),
+                         (int32_t) tiff_get_u32(tiff, entry->offset + i * 4));
+                dyn_buffer_append_string(out, tmp);
+            }
+            break;
+        case TIFF_RATIONAL:
+        case TIFF_SRATIONAL:
+            for (uint32_t i = 0; i < entry->count; i++) {
+                snprintf(tmp, sizeof(tmp), "%s%7i:%-7i", tiff_auto_sep(entry->count, i, 4),
+                         (int32_t) tiff_get_u32(tiff, entry->offset + i * 8),
+                         (int32_t) tiff_get_u32(tiff, entry->offset + i * 8 + 4));
+                dyn_buffer_append_string(out, tmp);
+            }
+            break;
+        case TIFF_DOUBLE:
+            for (uint32_t i = 0; i < entry->count; i++) {
+                snprintf(tmp, sizeof(tmp), "%s%.15g", tiff_auto_sep(entry->count, i, 4),
+                         tiff_get_double(tiff, entry->offset + i * 8));
+                dyn_buffer_append_string(out, tmp);
+            }
+            break;
+        default:
+            break;
+    }
+    dyn_buffer_write_char(out, '\0');
+}
+
+typedef struct {
+    enum exif_ifd ifd;
+    uint16_t tag;
+    enum metakey key;
+} exif_field_t;
+
+static const exif_field_t ExifFields[] = {
+        {ExifIfdMain, 0x010E, MetaContent},
+        {ExifIfdMain, 0x010F, MetaExifMake},
+        {ExifIfdMain, 0x0110, MetaExifModel},
+        {ExifIfdMain, 0x0131, MetaExifSoftware},
+        {ExifIfdMain, 0x0132, MetaExifDateTime},
+        {ExifIfdMain, 0x013B, MetaArtist},
+        {ExifIfdExif, 0x829A, MetaExifExposureTime},
+        {ExifIfdExif, 0x829D, MetaExifFNumber},
+        {ExifIfdExif, 0x8827, MetaExifIsoSpeedRatings},
+        {ExifIfdExif, 0x920A, MetaExifFocalLength},
+        {ExifIfdExif, 0x9286, MetaExifUserComment},
+        {ExifIfdGps, 0x0001, MetaExifGpsLatitudeRef},
+        {ExifIfdGps, 0x0002, MetaExifGpsLatitudeDMS},
+        {ExifIfdGps, 0x0003, MetaExifGpsLongitudeRef},
+        {ExifIfdGps, 0x0004, MetaExifGpsLongitudeDMS},
+};
+
+#define EXIF_FIELD_COUNT (sizeof(ExifFields) / sizeof(ExifFields[0]))
+
+typedef struct {
+    const char *name;
+    enum metakey key;
+} xmp_field_t;
+
+// XMP properties, only used when the equivalent EXIF field is missing
+static const xmp_field_t XmpFields[] = {
+        {"dc:description",  MetaContent},
+        {"dc:title",        MetaTitle},
+        {"dc:creator",      MetaArtist},
+        {"tiff:Make",       MetaExifMake},
+        {"tiff:Model",      MetaExifModel},
+        {"xmp:CreatorTool", MetaExifSoftware},
+};
+
+#define XMP_FIELD_COUNT (sizeof(XmpFields) / sizeof(XmpFields[0]))
+
+typedef struct {
+    // Formatted value of each ExifFields entry, or NULL
+    char *values[EXIF_FIELD_COUNT];
+    // Value of each XmpFields entry, or NULL
+    char *xmp_values[XMP_FIELD_COUNT];
+
+    int width;
+    int height;
+
+    // Decimal degrees, only valid if has_gps_*
+    double gps_latitude;
+    double gps_longitude;
+    int has_gps_latitude;
+    int has_gps_longitude;
+    char gps_latitude_ref;
+    char gps_longitude_ref;
+
+    // XMP packet embedded in the TIFF structure, points inside the TIFF buffer
+    const char *xmp;
+    size_t xmp_len;
+
+    // Embedded thumbnail (IFD1), points inside the TIFF buffer
+    const unsigned char *tn;
+    size_t tn_len;
+} exif_t;
+
+static void exif_read_field(void *data, const tiff_t *tiff, enum exif_ifd ifd, const tiff_entry_t *entry) {
+    exif_t *exif = data;
+
+    if (ifd == ExifIfdMain && entry->count == 1) {
+        if (entry->tag == TIFF_TAG_WIDTH) {
+            exif->width = (int) tiff_get_int(tiff, entry);
+        } else if (entry->tag == TIFF_TAG_HEIGHT) {
+            exif->height = (int) tiff_get_int(tiff, entry);
+        }
+    }
+
+    if (ifd == ExifIfdMain && entry->tag == TIFF_TAG_XMP
+        && (entry->type == TIFF_BYTE || entry->type == TIFF_UNDEFINED)) {
+        exif->xmp = (const char *) tiff->buf + entry->offset;
+        exif->xmp_len = entry->count;
+    }
+
+    if (ifd == ExifIfdGps) {
+        if ((entry->tag == GPS_TAG_LATITUDE || entry->tag == GPS_TAG_LONGITUDE)
+            && entry->type == TIFF_RATIONAL && entry->count == 3) {
+
+            double dms[3];
+            for (int i = 0; i < 3; i++) {
+                uint32_t denom = tiff_get_u32(tiff, entry->offset + i * 8 + 4);
+                dms[i] = denom == 0 ? 0 : (double) tiff_get_u32(tiff, entry->offset + i * 8) / denom;
+            }
+            double degrees = dms[0] + dms[1] / 60 + dms[2] / 3600;
+
+            if (entry->tag == GPS_TAG_LATITUDE) {
+                exif->gps_latitude = degrees;
+                exif->has_gps_latitude = TRUE;
+            } else {
+                exif->gps_longitude = degrees;
+                exif->has_gps_longitude = TRUE;
+            }
+        } else if (entry->tag == GPS_TAG_LATITUDE_REF && entry->type == TIFF_STRING) {
+            exif->gps_latitude_ref = (char) tiff->buf[entry->offset];
+        } else if (entry->tag == GPS_TAG_LONGITUDE_REF && entry->type == TIFF_STRING) {
+            exif->gps_longitude_ref = (char) tiff->buf[entry->offset];
+        }
+    }
+
+    for (int i = 0; i < EXIF_FIELD_COUNT; i++) {
+        if (ExifFields[i].ifd == ifd && ExifFields[i].tag == entry->tag) {
+            dyn_buffer_t buf = dyn_buffer_create();
+            tiff_format_value(tiff, entry, &buf);
+
+            // Last occurrence wins
+            free(exif->values[i]);
+            exif->values[i] = buf.buf;
+            return;
+        }
+    }
+}
+
+static void exif_read_thumbnail_field(void *data, const tiff_t *tiff, enum exif_ifd ifd, const tiff_entry_t *entry) {
+    uint32_t *tn = data;
+
+    if (ifd == ExifIfdMain && entry->count == 1) {
+        if (entry->tag == TIFF_TAG_JPEG_OFFSET) {
+            tn[0] = (uint32_t) tiff_get_int(tiff, entry);
+        } else if (entry->tag == TIFF_TAG_JPEG_LENGTH) {
+            tn[1] = (uint32_t) tiff_get_int(tiff, entry);
+        }
+    }
+}
+
+/*
+ * Read the EXIF fields of IFD0 (and its sub-IFDs) and locate the
+ * JPEG thumbnail of IFD1. Free with exif_destroy()
+ */
+static void exif_read(const tiff_t *tiff, exif_t *exif) {
+    memset(exif, 0, sizeof(exif_t));
+
+    uint32_t ifd1 = tiff_walk_ifd(tiff, tiff->ifd0, ExifIfdMain, 0, exif_read_field, exif);
+    if (ifd1 == 0 || ifd1 == tiff->ifd0) {
+        return;
+    }
+
+    uint32_t tn[2] = {0, 0};
+    tiff_walk_ifd(tiff, ifd1, ExifIfdMain, EXIF_MAX_DEPTH, exif_read_thumbnail_field, tn);
+
+    if (tn[0] != 0 && tn[1] > 2 && tn[0] < tiff->len && tn[1] <= tiff->len - tn[0]
+        && tiff->buf[tn[0]] == 0xFF && tiff->buf[tn[0] + 1] == 0xD8) {
+        exif->tn = tiff->buf + tn[0];
+        exif->tn_len = tn[1];
+    }
+}
+
+static void exif_destroy(exif_t *exif) {
+    for (int i = 0; i < EXIF_FIELD_COUNT; i++) {
+        free(exif->values[i]);
+    }
+    for (int i = 0; i < XMP_FIELD_COUNT; i++) {
+        free(exif->xmp_values[i]);
+    }
+}
+
+#define EXIF_DMS_REF(ref) (((ref) == 'S' || (ref) == 'W') ? -1 : 1)
+
+static double exif_gps_latitude_dec(const exif_t *exif) {
+    return exif->gps_latitude * EXIF_DMS_REF(exif->gps_latitude_ref);
+}
+
+static double exif_gps_longitude_dec(const exif_t *exif) {
+    return exif->gps_longitude * EXIF_DMS_REF(exif->gps_longitude_ref);
+}
+
+/*
+ * Copy an XML text value, decoding the predefined entities
+ */
+static char *xmp_strndup_unescape(const char *str, size_t len) {
+    char *out = malloc(len + 1);
+    size_t j = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] == '&') {
+            static const char *entities[][2] = {
+                    {"&amp;",  "&"},
+                    {"&lt;",   "<"},
+                    {"&gt;",   ">"},
+                    {"&quot;", "\""},
+                    {"&apos;", "'"},
+            };
+            int found = FALSE;
+            for (int k = 0; k < 5; k++) {
+                size_t entity_len = strlen(entities[k][0]);
+                if (len - i >= entity_len && strncmp(str + i, entities[k][0], entity_len) == 0) {
+                    out[j++] = entities[k][1][0];
+                    i += entity_len - 1;
+                    found = TRUE;
+                    break;
+                }
+            }
+            if (found) {
+                continue;
+            }
+        }
+        out[j++] = str[i];
+    }
+    out[j] = '\0';
+    return out;
+}
+
+/*
+ * Value of an XMP property, written either as an attribute (name="value"),
+ * a simple element (<name>value</name>) or an rdf container (the first <rdf:li>).
+ * Returns NULL if the property is not found
+ */
+static char *xmp_get_property(const char *xmp, size_t len, const char *name) {
+    const char *end = xmp + len;
+    size_t name_len = strlen(name);
+    const char *ptr = xmp;
+
+    while ((ptr = memmem(ptr, end - ptr, name, name_len)) != NULL) {
+        const char *after = ptr + name_len;
+        if (ptr == xmp || after >= end) {
+            ptr = after;
+            continue;
+        }
+
+        if (ptr[-1] == '<' && (*after == '>' || *after == ' ' || *after == '\n' || *after == '\t')) {
+            const char *content = memchr(after, '>', end - after);
+            if (content == NULL || content[-1] == '/') {
+                ptr = after;
+                continue;
+            }
+            content += 1;
+
+            const char *text_end = memchr(content, '<', end - content);
+            if (text_end == NULL) {
+                return NULL;
+            }
+
+            // <rdf:Alt>, <rdf:Seq> or <rdf:Bag>: the first item is read
+            if (end - text_end >= 5 && strncmp(text_end, "<rdf:", 5) == 0) {
+                const char *li = memmem(text_end, end - text_end, "<rdf:li", 7);
+                if (li == NULL || (content = memchr(li, '>', end - li)) == NULL || content[-1] == '/') {
+                    return NULL;
+                }
+                content += 1;
+
+                text_end = memchr(content, '<', end - content);
+                if (text_end == NULL) {
+                    return NULL;
+                }
+            }
+            return xmp_strndup_unescape(content, text_end - content);
+        }
+
+        if ((ptr[-1] == ' ' || ptr[-1] == '\n' || ptr[-1] == '\t') && end - after >= 2
+            && after[0] == '=' && (after[1] == '"' || after[1] == '\'')) {
+            const char *value = after + 2;
+            const char *value_end = memchr(value, after[1], end - value);
+            if (value_end == NULL) {
+                return NULL;
+            }
+            return xmp_strndup_unescape(value, value_end - value);
+        }
+
+        ptr = after;
+    }
+
+    return NULL;
+}
+
+/*
+ * XMP GPS coordinates are written as "DDD,MM,SSk" or "DDD,MM.mmk" where k is N, S, E or W
+ */
+static int xmp_parse_gps(const char *str, double *degrees, char *ref) {
+    double parts[3] = {0, 0, 0};
+    const char *ptr = str;
+
+    for (int i = 0; i < 3; i++) {
+        char *next;
+        parts[i] = strtod(ptr, &next);
+        if (next == ptr) {
+            return FALSE;
+        }
+        ptr = next;
+        if (*ptr != ',') {
+            break;
+        }
+        ptr += 1;
+    }
+
+    if (*ptr != 'N' && *ptr != 'S' && *ptr != 'E' && *ptr != 'W') {
+        return FALSE;
+    }
+
+    *degrees = parts[0] + parts[1] / 60 + parts[2] / 3600;
+    *ref = *ptr;
+    return TRUE;
+}
+
+/*
+ * Read the XmpFields properties of an XMP packet, and the GPS position if
+ * the EXIF data did not have it
+ */
+static void exif_read_xmp(exif_t *exif, const char *xmp, size_t len) {
+    for (int i = 0; i < XMP_FIELD_COUNT; i++) {
+        free(exif->xmp_values[i]);
+        exif->xmp_values[i] = xmp_get_property(xmp, len, XmpFields[i].name);
+    }
+
+    if (!exif->has_gps_latitude) {
+        char *value = xmp_get_property(xmp, len, "exif:GPSLatitude");
+        if (value != NULL) {
+            exif->has_gps_latitude = xmp_parse_gps(value, &exif->gps_latitude, &exif->gps_latitude_ref);
+            free(value);
+        }
+    }
+
+    if (!exif->has_gps_longitude) {
+        char *value = xmp_get_property(xmp, len, "exif:GPSLongitude");
+        if (value != NULL) {
+            exif->has_gps_longitude = xmp_parse_gps(value, &exif->gps_longitude, &exif->gps_longitude_ref);
+            free(value);
+        }
+    }
+}
+
+typedef struct {
+    int width;
+    int height;
+    // Contents of the APP1 EXIF segment (TIFF header onwards), or NULL
+    const unsigned char *exif;
+    size_t exif_len;
+    // XMP packet of the APP1 XMP segment, or NULL
+    const char *xmp;
+    size_t xmp_len;
+} jpeg_header_t;
+
+#define XMP_SIGNATURE "http://ns.adobe.com/xap/1.0/"
+
+#define JPEG_IS_SOF(m) ((m) >= 0xC0 && (m) <= 0xCF && (m) != 0xC4 && (m) != 0xC8 && (m) != 0xCC)
+
+/*
+ * Walk the JPEG markers up to the first frame header.
+ * Returns FALSE if buf is not a JPEG or if the frame header is not in buf
+ */
+static int jpeg_read_header(const unsigned char *buf, size_t len, jpeg_header_t *header) {
+    memset(header, 0, sizeof(jpeg_header_t));
+
+    if (len < 4 || buf[0] != 0xFF || buf[1] != 0xD8) {
+        return FALSE;
+    }
+
+    size_t i = 2;
+    while (i + 4 <= len) {
+        if (buf[i] != 0xFF) {
+            return FALSE;
+        }
+        unsigned char marker = buf[i + 1];
+        if (marker == 0xFF) {
+            // Fill byte
+            i += 1;
+            continue;
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+            i += 2;
+            continue;
+        }
+        if (marker == 0xD9 || marker == 0xDA) {
+            return FALSE;
+        }
+
+        size_t segment_len = buf[i + 2] << 8 | buf[i + 3];
+        if (segment_len < 2) {
+            return FALSE;
+        }
+
+        if (JPEG_IS_SOF(marker)) {
+            if (i + 9 > len) {
+                return FALSE;
+            }
+            header->height = buf[i + 5] << 8 | buf[i + 6];
+            header->width = buf[i + 7] << 8 | buf[i + 8];
+            return TRUE;
+        }
+
+        if (marker == 0xE1 && header->exif == NULL && segment_len > 8 && i + 2 + segment_len <= len
+            && memcmp(buf + i + 4, "Exif\0\0", 6) == 0) {
+            header->exif = buf + i + 10;
+            header->exif_len = segment_len - 8;
+        } else if (marker == 0xE1 && header->xmp == NULL && segment_len > 2 + sizeof(XMP_SIGNATURE)
+                   && i + 2 + segment_len <= len && memcmp(buf + i + 4, XMP_SIGNATURE, sizeof(XMP_SIGNATURE)) == 0) {
+            header->xmp = (const char *) buf + i + 4 + sizeof(XMP_SIGNATURE);
+            header->xmp_len = segment_len - 2 - sizeof(XMP_SIGNATURE);
+        }
+
+        i += 2 + segment_len;
+    }
+
+    return FALSE;
+}
+
+#endif
@@ -1,12 +1,23 @@
 #include "media.h"
+#include "exif.h"
+#include "audio_tags.h"
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 #define MIN_SIZE 32
 #define AVIO_BUF_SIZE 8192
+#define EXIF_HEADER_MIN_SIZE (1024 * 16)
+#define EXIF_HEADER_SIZE (1024 * 128)
+// Thumbnail frames of a video (contact sheet cells or separate thumbnails)
+#define MAX_TN_FRAMES 64
+// Frames read after a uniform frame, the last one is used even if it is uniform
+#define TN_UNIFORM_RETRIES 2
+#define IS_EXIF_MIME(mime_str) (strcmp(mime_str, "image/jpeg") == 0 || strcmp(mime_str, "image/tiff") == 0)
 #define IS_VIDEO(fmt) (fmt->iformat->name && strcmp(fmt->iformat->name, "image2") != 0)
 
-#define STORE_AS_IS ((void*)-1)
-
 const char *get_filepath_with_ext(document_t *doc, const char *filepath, const char *mime_str) {
 
     int has_extension = doc->ext > doc->base;
@@ -22,66 +33,6 @@ const char *get_filepath_with_ext(document_t *doc, const char *filepath, const c
     return filepath;
 }
 
-
-__always_inline
-void *scale_frame(const AVCodecContext *decoder, const AVFrame *frame, int size) {
-
-    if (frame->pict_type == AV_PICTURE_TYPE_NONE) {
-        return NULL;
-    }
-
-    int dstW;
-    int dstH;
-    if (frame->width <= size && frame->height <= size) {
-        if (decoder->codec_id == AV_CODEC_ID_MJPEG || decoder->codec_id == AV_CODEC_ID_PNG) {
-            return STORE_AS_IS;
-        }
-
-        dstW = frame->width;
-        dstH = frame->height;
-    } else {
-        double ratio = (double) frame->width / frame->height;
-        if (frame->width > frame->height) {
-            dstW = size;
-            dstH = (int) (size / ratio);
-        } else {
-            dstW = (int) (size * ratio);
-            dstH = size;
-        }
-    }
-
-    if (dstW <= MIN_SIZE || dstH <= MIN_SIZE) {
-        return NULL;
-    }
-
-    AVFrame *scaled_frame = av_frame_alloc();
-
-    struct SwsContext *sws_ctx = sws_getContext(
-            decoder->width, decoder->height, decoder->pix_fmt,
-            dstW, dstH, AV_PIX_FMT_YUVJ420P,
-            SIST_SWS_ALGO, 0, 0, 0
-    );
-
-    int dst_buf_len = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, dstW, dstH, 1);
-    uint8_t *dst_buf = (uint8_t *) av_malloc(dst_buf_len * 2);
-
-    av_image_fill_arrays(scaled_frame->data, scaled_frame->linesize, dst_buf, AV_PIX_FMT_YUV420P, dstW, dstH, 1);
-
-    sws_scale(sws_ctx,
-              (const uint8_t *const *) frame->data, frame->linesize,
-              0, decoder->height,
-              scaled_frame->data, scaled_frame->linesize
-    );
-
-    scaled_frame->width = dstW;
-    scaled_frame->height = dstH;
-    scaled_frame->format = AV_PIX_FMT_YUV420P;
-
-    sws_freeContext(sws_ctx);
-
-    return scaled_frame;
-}
-
 typedef struct {
     AVPacket *packet;
     AVFrame *frame;
@@ -100,62 +51,167 @@ static void frame_and_packet_free(frame_and_packet_t *frame_and_packet) {
     free(frame_and_packet);
 }
 
-__always_inline
-static void read_subtitles(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, int stream_idx, document_t *doc) {
+/*
+ * Store the thumbnails of a decoded frame, returns FALSE if the frame is unusable or too small
+ */
+static int store_frame_thumbnail(scan_media_ctx_t *ctx, const AVCodecContext *decoder,
+                                 const frame_and_packet_t *frame_and_packet, const int *tn_sizes, size_t max_size,
+                                 int dhash, document_t *doc) {
 
-    text_buffer_t tex = text_buffer_create(-1);
+    const AVFrame *frame = frame_and_packet->frame;
 
-    AVPacket packet;
-    AVSubtitle subtitle;
+    if (frame->pict_type == AV_PICTURE_TYPE_NONE) {
+        return FALSE;
+    }
+
+    int store_as_is = (tn_sizes == NULL || tn_sizes[0] == 0) && !dhash;
+
+    if (store_as_is && frame->width <= ctx->tn_size && frame->height <= ctx->tn_size
+        && frame_and_packet->packet->size > 0
+        && (decoder->codec_id == AV_CODEC_ID_MJPEG || decoder->codec_id == AV_CODEC_ID_PNG)
+        && decoder->lowres == 0) {
+
+        APPEND_TN_META(doc, frame->width, frame->height)
+        ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) frame_and_packet->packet->data,
+                   frame_and_packet->packet->size);
+        return TRUE;
+    }
+
+    return thumbnail_store_sizes(ctx->store, doc, (const uint8_t *const *) frame->data, frame->linesize,
+                                 frame->width, frame->height, frame->format,
+                                 ctx->tn_size, tn_sizes, ctx->tn_qscale, max_size, dhash) > 0;
+}
+
+static void append_subtitle_text(text_buffer_t *tex, AVSubtitle *subtitle) {
+    for (int i = 0; i < subtitle->num_rects; i++) {
+        const char *text = subtitle->rects[i]->ass;
+
+        if (text == NULL) {
+            continue;
+        }
+
+        char *idx = strstr(text, "\\N");
+        if (idx != NULL && strlen(idx + 2) > 1) {
+            text_buffer_append_string0(tex, idx + 2);
+            text_buffer_append_char(tex, ' ');
+        }
+    }
+}
+
+static AVCodecContext *open_subtitle_decoder(AVStream *stream) {
+    AVCodec *subtitle_codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (subtitle_codec == NULL) {
+        return NULL;
+    }
 
-    AVCodec *subtitle_codec = avcodec_find_decoder(pFormatCtx->streams[stream_idx]->codecpar->codec_id);
     AVCodecContext *decoder = avcodec_alloc_context3(subtitle_codec);
-    avcodec_parameters_to_context(decoder, pFormatCtx->streams[stream_idx]->codecpar);
-    avcodec_open2(decoder, subtitle_codec, NULL);
+    avcodec_parameters_to_context(decoder, stream->codecpar);
+    if (avcodec_open2(decoder, subtitle_codec, NULL) != 0) {
+        avcodec_free_context(&decoder);
+        return NULL;
+    }
 
     decoder->sub_text_format = FF_SUB_TEXT_FMT_ASS;
+    return decoder;
+}
 
-    int got_sub;
+/*
+ * Read the subtitles (the first subtitle stream, or all of them with read_all_subtitle_streams) in a single
+ * pass over the file. When video_decoder is not NULL, the first keyframe at or after tn_target (in the video
+ * stream's time base) is decoded on the way and returned for the thumbnail.
+ * Stops at EOF, or once max_subtitle_bytes of the file were read.
+ */
+static frame_and_packet_t *
+read_subtitles(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, int subtitle_stream, int video_stream,
+               AVCodecContext *video_decoder, int64_t tn_target, document_t *doc) {
 
-    while (1) {
-        int read_frame_ret = av_read_frame(pFormatCtx, &packet);
+    text_buffer_t tex = text_buffer_create(-1);
 
-        if (read_frame_ret != 0) {
-            break;
+    // Demuxers without a header (MPEG-TS/PS...) can add streams while reading
+    unsigned int decoder_count = pFormatCtx->nb_streams;
+    AVCodecContext **decoders = calloc(decoder_count, sizeof(AVCodecContext *));
+    for (int i = 0; i < decoder_count; i++) {
+        AVStream *stream = pFormatCtx->streams[i];
+        if (i == subtitle_stream
+            || (ctx->read_all_subtitle_streams && stream->codecpar->codec_type == AVMEDIA_TYPE_SUBTITLE)) {
+            decoders[i] = open_subtitle_decoder(stream);
         }
+    }
 
-        if (packet.stream_index != stream_idx) {
-            av_packet_unref(&packet);
-            continue;
-        }
+    AVPacket *packet = av_packet_alloc();
+    AVSubtitle subtitle;
+    int got_sub;
 
-        avcodec_decode_subtitle2(decoder, &subtitle, &got_sub, &packet);
+    frame_and_packet_t *result = NULL;
+    int decoding_video = FALSE;
+    int eof = TRUE;
 
-        if (got_sub) {
-            for (int i = 0; i < subtitle.num_rects; i++) {
-                const char *text = subtitle.rects[i]->ass;
+    while (av_read_frame(pFormatCtx, packet) == 0) {
+        int stream_idx = packet->stream_index;
 
-                if (text == NULL) {
-                    continue;
-                }
+        if (stream_idx >= decoder_count) {
+            // Stream added after the decoders were opened
+        } else if (decoders[stream_idx] != NULL) {
+            if (avcodec_decode_subtitle2(decoders[stream_idx], &subtitle, &got_sub, packet) >= 0 && got_sub) {
+                append_subtitle_text(&tex, &subtitle);
+                avsubtitle_free(&subtitle);
+            }
+        } else if (stream_idx == video_stream && video_decoder != NULL && result == NULL) {
+            int64_t ts = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+
+            if (!decoding_video && (packet->flags & AV_PKT_FLAG_KEY) && (ts == AV_NOPTS_VALUE || ts >= tn_target)) {
+                decoding_video = TRUE;
+            }
 
-                char *idx = strstr(text, "\\N");
-                if (idx != NULL && strlen(idx + 2) > 1) {
-                    text_buffer_append_string0(&tex, idx + 2);
-                    text_buffer_append_char(&tex, ' ');
+            if (decoding_video && avcodec_send_packet(video_decoder, packet) == 0) {
+                AVFrame *frame = av_frame_alloc();
+                if (avcodec_receive_frame(video_decoder, frame) == 0) {
+                    result = calloc(1, sizeof(frame_and_packet_t));
+                    result->frame = frame;
+                    result->packet = av_packet_clone(packet);
+                } else {
+                    av_frame_free(&frame);
                 }
             }
-            avsubtitle_free(&subtitle);
         }
 
-        av_packet_unref(&packet);
+        av_packet_unref(packet);
+
+        if (ctx->max_subtitle_bytes > 0 && avio_tell(pFormatCtx->pb) > ctx->max_subtitle_bytes) {
+            CTX_LOG_DEBUGF(doc->filepath, "Stopped reading subtitles after %ldB", ctx->max_subtitle_bytes)
+            eof = FALSE;
+            break;
+        }
+    }
+
+    // Frames still buffered by the decoder (frame threading, B-frames)
+    if (eof && decoding_video && result == NULL && avcodec_send_packet(video_decoder, NULL) == 0) {
+        AVFrame *frame = av_frame_alloc();
+        if (avcodec_receive_frame(video_decoder, frame) == 0) {
+            result = calloc(1, sizeof(frame_and_packet_t));
+            result->frame = frame;
+            // Not the packet of this frame, it can't be stored as-is
+            result->packet = av_packet_alloc();
+        } else {
+            av_frame_free(&frame);
+        }
     }
 
+    av_packet_free(&packet);
+
     text_buffer_terminate_string(&tex);
 
     APPEND_STR_META(doc, MetaContent, tex.dyn_buffer.buf)
     text_buffer_destroy(&tex);
-    avcodec_free_context(&decoder);
+
+    for (int i = 0; i < decoder_count; i++) {
+        if (decoders[i] != NULL) {
+            avcodec_free_context(&decoders[i]);
+        }
+    }
+    free(decoders);
+
+    return result;
 }
 
 __always_inline
@@ -216,14 +272,9 @@ read_frame(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *d
 
 void append_tag_meta_if_not_exists(scan_media_ctx_t *ctx, document_t *doc, AVDictionaryEntry *tag, enum metakey key) {
 
-    meta_line_t *meta = doc->meta_head;
-    while (meta != NULL) {
-        if (meta->key == key) {
-            CTX_LOG_DEBUGF(doc->filepath, "Ignoring duplicate tag: '%02x=%s' and '%02x=%s'",
-                           key, meta->str_val, key, tag->value)
-            return;
-        }
-        meta = meta->next;
+    if (HAS_META_KEY(doc, key)) {
+        CTX_LOG_DEBUGF(doc->filepath, "Ignoring duplicate tag: '%02x=%s'", key, tag->value)
+        return;
     }
 
     text_buffer_t tex = text_buffer_create(-1);
@@ -240,116 +291,595 @@ void append_tag_meta_if_not_exists(scan_media_ctx_t *ctx, document_t *doc, AVDic
 #define APPEND_TAG_META(keyname) \
     APPEND_UTF8_META(doc, keyname, tag->value)
 
-#define STRCPY_TOLOWER(dst, str) \
-    strncpy(dst, str, sizeof(dst)); \
-    char *ptr = dst; \
-    for (; *ptr; ++ptr) *ptr = (char) tolower(*ptr);
+typedef struct {
+    const char *name;
+    enum metakey key;
+    // TAG_* flags of the metadata dictionaries the tag is read from
+    int sources;
+} tag_key_t;
+
+/*
+ * Perfect hash of the (lowercase) tag names below, see tag_key_hash().
+ * When adding a tag, pick new multipliers if two names end up in the same slot:
+ * media_tag_table_check() fails when a name is not in the slot of its hash.
+ */
+#define TAG_KEY_TABLE_SIZE 32
+
+static const tag_key_t TagKeys[TAG_KEY_TABLE_SIZE] = {
+        [0] = {"title", MetaTitle, TAG_AUDIO | TAG_VIDEO},
+        [3] = {"gpslatituderef", MetaExifGpsLatitudeRef, TAG_EXIF},
+        [4] = {"software", MetaExifSoftware, TAG_EXIF},
+        [5] = {"isospeedratings", MetaExifIsoSpeedRatings, TAG_EXIF},
+        [6] = {"gpslongituderef", MetaExifGpsLongitudeRef, TAG_EXIF},
+        [7] = {"focallength", MetaExifFocalLength, TAG_EXIF},
+        [9] = {"album", MetaAlbum, TAG_AUDIO},
+        [10] = {"exposuretime", MetaExifExposureTime, TAG_EXIF},
+        [11] = {"artist", MetaArtist, TAG_AUDIO | TAG_VIDEO | TAG_EXIF},
+        [17] = {"gpslatitude", MetaExifGpsLatitudeDMS, TAG_EXIF},
+        [20] = {"gpslongitude", MetaExifGpsLongitudeDMS, TAG_EXIF},
+        [21] = {"fnumber", MetaExifFNumber, TAG_EXIF},
+        [24] = {"comment", MetaContent, TAG_AUDIO | TAG_VIDEO},
+        [25] = {"datetime", MetaExifDateTime, TAG_EXIF},
+        [26] = {"make", MetaExifMake, TAG_EXIF},
+        [27] = {"imagedescription", MetaContent, TAG_EXIF},
+        [28] = {"model", MetaExifModel, TAG_EXIF},
+        [29] = {"album_artist", MetaAlbumArtist, TAG_AUDIO},
+        [30] = {"usercomment", MetaExifUserComment, TAG_EXIF},
+        [31] = {"genre", MetaGenre, TAG_AUDIO},
+};
+
+static unsigned int tag_key_hash(const char *name, size_t len) {
+    return (unsigned int) (len * 3 + tolower(name[0]) * 5 + tolower(name[len - 1]) * 9) & (TAG_KEY_TABLE_SIZE - 1);
+}
+
+enum metakey media_tag_key(const char *name, int source) {
+    size_t len = strlen(name);
+    if (len == 0) {
+        return 0;
+    }
+
+    const tag_key_t *tag_key = &TagKeys[tag_key_hash(name, len)];
+    if (tag_key->name == NULL || !(tag_key->sources & source) || strcasecmp(name, tag_key->name) != 0) {
+        return 0;
+    }
+    return tag_key->key;
+}
+
+int media_tag_table_check() {
+    for (int i = 0; i < TAG_KEY_TABLE_SIZE; i++) {
+        if (TagKeys[i].name != NULL && tag_key_hash(TagKeys[i].name, strlen(TagKeys[i].name)) != i) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
 
 __always_inline
-static void append_audio_meta(AVFormatContext *pFormatCtx, document_t *doc) {
+static void append_audio_meta(AVFormatContext *pFormatCtx, document_t *doc, int with_duration) {
 
     AVDictionaryEntry *tag = NULL;
     while ((tag = av_dict_get(pFormatCtx->metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
-        char key[256];
-        STRCPY_TOLOWER(key, tag->key)
+        enum metakey key = media_tag_key(tag->key, TAG_AUDIO);
+        if (key != 0) {
+            APPEND_TAG_META(key)
+        }
+    }
+
+    // Same as parse_audio_tags_file(): only when it is known
+    if (with_duration && pFormatCtx->duration > 0 && pFormatCtx->duration / AV_TIME_BASE <= INT32_MAX) {
+        APPEND_LONG_META(doc, MetaMediaDuration, pFormatCtx->duration / AV_TIME_BASE)
+    }
+}
 
-        if (strcmp(key, "artist") == 0) {
-            APPEND_TAG_META(MetaArtist)
-        } else if (strcmp(key, "genre") == 0) {
-            APPEND_TAG_META(MetaGenre)
-        } else if (strcmp(key, "title") == 0) {
-            APPEND_TAG_META(MetaTitle)
-        } else if (strcmp(key, "album_artist") == 0) {
-            APPEND_TAG_META(MetaAlbumArtist)
-        } else if (strcmp(key, "album") == 0) {
-            APPEND_TAG_META(MetaAlbum)
-        } else if (strcmp(key, "comment") == 0) {
-            APPEND_TAG_META(MetaContent)
+/*
+ * Duration, bitrate and tags of the container, available before decoding any frame
+ */
+__always_inline
+static void append_video_meta(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, document_t *doc) {
+
+    meta_line_t *meta_duration = malloc(sizeof(meta_line_t));
+    meta_duration->key = MetaMediaDuration;
+    meta_duration->long_val = pFormatCtx->duration / AV_TIME_BASE;
+    if (meta_duration->long_val > INT32_MAX) {
+        meta_duration->long_val = 0;
+    }
+    APPEND_META(doc, meta_duration)
+
+    meta_line_t *meta_bitrate = malloc(sizeof(meta_line_t));
+    meta_bitrate->key = MetaMediaBitrate;
+    meta_bitrate->long_val = pFormatCtx->bit_rate;
+    APPEND_META(doc, meta_bitrate)
+
+    AVDictionaryEntry *tag = NULL;
+    while ((tag = av_dict_get(pFormatCtx->metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
+        enum metakey key = media_tag_key(tag->key, TAG_VIDEO);
+        if (key != 0) {
+            append_tag_meta_if_not_exists(ctx, doc, tag, key);
         }
     }
 }
 
+/*
+ * EXIF metadata of a decoded image, when it was not already parsed from the file
+ */
 __always_inline
-static void
-append_video_meta(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, AVFrame *frame, document_t *doc, int is_video) {
+static void append_frame_exif_meta(scan_media_ctx_t *ctx, AVFrame *frame, document_t *doc) {
+
+    AVDictionaryEntry *tag = NULL;
+    while ((tag = av_dict_get(frame->metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
+        enum metakey key = media_tag_key(tag->key, TAG_EXIF);
+        if (key == MetaArtist) {
+            append_tag_meta_if_not_exists(ctx, doc, tag, key);
+        } else if (key != 0) {
+            APPEND_TAG_META(key)
+        }
+    }
+}
+
+static void append_exif_meta(scan_media_ctx_t *ctx, exif_t *exif, document_t *doc) {
 
-    if (is_video) {
-        meta_line_t *meta_duration = malloc(sizeof(meta_line_t));
-        meta_duration->key = MetaMediaDuration;
-        meta_duration->long_val = pFormatCtx->duration / AV_TIME_BASE;
-        if (meta_duration->long_val > INT32_MAX) {
-            meta_duration->long_val = 0;
+    for (int i = 0; i < EXIF_FIELD_COUNT; i++) {
+        if (exif->values[i] == NULL) {
+            continue;
         }
-        APPEND_META(doc, meta_duration)
 
-        meta_line_t *meta_bitrate = malloc(sizeof(meta_line_t));
-        meta_bitrate->key = MetaMediaBitrate;
-        meta_bitrate->long_val = pFormatCtx->bit_rate;
-        APPEND_META(doc, meta_bitrate)
+        if (ExifFields[i].key == MetaArtist) {
+            AVDictionaryEntry tag = {.key = "artist", .value = exif->values[i]};
+            append_tag_meta_if_not_exists(ctx, doc, &tag, MetaArtist);
+        } else {
+            APPEND_UTF8_META(doc, ExifFields[i].key, exif->values[i])
+        }
     }
 
-    AVDictionaryEntry *tag = NULL;
-    if (is_video) {
-        while ((tag = av_dict_get(pFormatCtx->metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
-            char key[256];
-            STRCPY_TOLOWER(key, tag->key)
-
-            if (strcmp(key, "title") == 0) {
-                append_tag_meta_if_not_exists(ctx, doc, tag, MetaTitle);
-            } else if (strcmp(key, "comment") == 0) {
-                append_tag_meta_if_not_exists(ctx, doc, tag, MetaContent);
-            } else if (strcmp(key, "artist") == 0) {
-                append_tag_meta_if_not_exists(ctx, doc, tag, MetaArtist);
+    for (int i = 0; i < XMP_FIELD_COUNT; i++) {
+        if (exif->xmp_values[i] == NULL) {
+            continue;
+        }
+        AVDictionaryEntry tag = {.key = (char *) XmpFields[i].name, .value = exif->xmp_values[i]};
+        append_tag_meta_if_not_exists(ctx, doc, &tag, XmpFields[i].key);
+    }
+
+    char tmp[64];
+    if (exif->has_gps_longitude && exif_gps_longitude_dec(exif) != 0.0) {
+        snprintf(tmp, sizeof(tmp), "%.15f", exif_gps_longitude_dec(exif));
+        APPEND_STR_META(doc, MetaExifGpsLongitudeDec, tmp)
+    }
+    if (exif->has_gps_latitude && exif_gps_latitude_dec(exif) != 0.0) {
+        snprintf(tmp, sizeof(tmp), "%.15f", exif_gps_latitude_dec(exif));
+        APPEND_STR_META(doc, MetaExifGpsLatitudeDec, tmp)
+    }
+}
+
+#define EXIF_NOT_PARSED 0
+#define EXIF_PARSED_META 1
+#define EXIF_PARSED_ALL 2
+
+/*
+ * Read the EXIF/XMP metadata of a JPEG or TIFF image from its header, without decoding the image.
+ * The embedded thumbnail is stored if it is large enough for tn_size.
+ *
+ * Returns EXIF_PARSED_ALL when the document is complete (metadata-only mode, or embedded thumbnail),
+ * EXIF_PARSED_META when a thumbnail still has to be decoded, and EXIF_NOT_PARSED (nothing appended) when
+ * the header could not be read from buf.
+ */
+static int parse_exif_image(scan_media_ctx_t *ctx, const unsigned char *buf, size_t len, document_t *doc,
+                            const char *mime_str) {
+
+    int is_jpeg = strcmp(mime_str, "image/jpeg") == 0;
+    jpeg_header_t header;
+    tiff_t tiff;
+    exif_t exif;
+
+    if (is_jpeg) {
+        if (!jpeg_read_header(buf, len, &header)) {
+            return EXIF_NOT_PARSED;
+        }
+        if (header.exif != NULL && tiff_init(&tiff, header.exif, header.exif_len)) {
+            exif_read(&tiff, &exif);
+        } else {
+            memset(&exif, 0, sizeof(exif));
+        }
+        if (header.xmp != NULL) {
+            exif_read_xmp(&exif, header.xmp, header.xmp_len);
+        }
+    } else {
+        if (!tiff_init(&tiff, buf, len)) {
+            return EXIF_NOT_PARSED;
+        }
+        exif_read(&tiff, &exif);
+        if (exif.xmp != NULL) {
+            exif_read_xmp(&exif, exif.xmp, exif.xmp_len);
+        }
+    }
+
+    int width = is_jpeg ? header.width : exif.width;
+    int height = is_jpeg ? header.height : exif.height;
+
+    if (width <= 0 || height <= 0) {
+        exif_destroy(&exif);
+        return EXIF_NOT_PARSED;
+    }
+
+    int use_embedded_tn = FALSE;
+    jpeg_header_t tn_header;
+    int metadata_only = ctx->tn_size <= 0 || ctx->metadata_only;
+
+    if (!metadata_only && ctx->tn_sizes[0] == 0 && !ctx->tn_dhash && exif.tn != NULL
+        && jpeg_read_header(exif.tn, exif.tn_len, &tn_header)) {
+        int min_size = ctx->tn_exif_min_size > 0 ? MIN(ctx->tn_exif_min_size, ctx->tn_size) : ctx->tn_size;
+        use_embedded_tn = MAX(tn_header.width, tn_header.height) >= min_size;
+    }
+
+    int ret = (metadata_only || use_embedded_tn) ? EXIF_PARSED_ALL : EXIF_PARSED_META;
+
+    if (ret == EXIF_PARSED_ALL) {
+        APPEND_STR_META(doc, MetaMediaVideoCodec, is_jpeg ? "mjpeg" : "tiff")
+        APPEND_LONG_META(doc, MetaWidth, width)
+        APPEND_LONG_META(doc, MetaHeight, height)
+    }
+
+    append_exif_meta(ctx, &exif, doc);
+
+    if (use_embedded_tn) {
+        CTX_LOG_DEBUGF(doc->filepath, "Using embedded EXIF thumbnail (%dx%d)", tn_header.width, tn_header.height)
+        APPEND_TN_META(doc, tn_header.width, tn_header.height)
+        ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) exif.tn, exif.tn_len);
+    }
+
+    exif_destroy(&exif);
+    return ret;
+}
+
+static int parse_exif_image_file(scan_media_ctx_t *ctx, const char *filepath, document_t *doc,
+                                 const char *mime_str) {
+    int fd = open(filepath, O_RDONLY);
+    if (fd == -1) {
+        return EXIF_NOT_PARSED;
+    }
+
+    // Most headers fit in the first few KB, only read more when they don't
+    unsigned char *buf = malloc(EXIF_HEADER_SIZE);
+    int ret = EXIF_NOT_PARSED;
+    ssize_t len = pread(fd, buf, EXIF_HEADER_MIN_SIZE, 0);
+    if (len > 0) {
+        ret = parse_exif_image(ctx, buf, len, doc, mime_str);
+    }
+    if (ret == EXIF_NOT_PARSED && len == EXIF_HEADER_MIN_SIZE) {
+        len = pread(fd, buf, EXIF_HEADER_SIZE, 0);
+        if (len > 0) {
+            ret = parse_exif_image(ctx, buf, len, doc, mime_str);
+        }
+    }
+
+    close(fd);
+    free(buf);
+    return ret;
+}
+
+static long audio_pread(void *data, void *buf, size_t len, size_t offset) {
+    return pread(*(int *) data, buf, len, (off_t) offset);
+}
+
+/**
+ * @return FALSE if the file must be read with ffmpeg instead
+ */
+static int parse_audio_tags_file(scan_media_ctx_t *ctx, vfile_t *f, document_t *doc) {
+    int fd = open(f->filepath, O_RDONLY);
+    if (fd == -1) {
+        return FALSE;
+    }
+
+    audio_reader_t reader = {audio_pread, &fd, f->info.st_size};
+    audio_tags_t tags;
+    int ret = audio_tags_read(&reader, &tags);
+    close(fd);
+
+    if (!ret) {
+        return FALSE;
+    }
+
+    // The cover art is decoded by ffmpeg
+    if (tags.has_picture && ctx->tn_size > 0 && !ctx->metadata_only) {
+        audio_tags_destroy(&tags);
+        return FALSE;
+    }
+
+    APPEND_STR_META(doc, MetaMediaAudioCodec, tags.codec)
+    for (int i = 0; i < AudioTagCount; i++) {
+        if (tags.values[i] != NULL) {
+            APPEND_UTF8_META(doc, AudioTagMetaKeys[i], tags.values[i])
+        }
+    }
+    if (tags.duration > 0 && tags.duration <= INT32_MAX) {
+        APPEND_LONG_META(doc, MetaMediaDuration, tags.duration)
+    }
+
+    audio_tags_destroy(&tags);
+    return TRUE;
+}
+
+static void set_probe_options(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx) {
+    if (ctx->probe_size > 0) {
+        pFormatCtx->probesize = ctx->probe_size;
+    }
+    if (ctx->max_analyze_duration > 0) {
+        pFormatCtx->max_analyze_duration = ctx->max_analyze_duration;
+    }
+}
+
+// Demuxers that read the codec parameters and the duration from the container header
+static const char *CompleteHeaderFormats[] = {
+        "matroska,webm",
+        "mov,mp4,m4a,3gp,3g2,mj2",
+        "flac",
+        "wav",
+        NULL
+};
+
+/*
+ * avformat_find_stream_info() opens a decoder and decodes frames of every stream. It can be skipped when
+ * the container header already has everything we need (always in metadata-only mode, for
+ * CompleteHeaderFormats with fast_stream_info)
+ */
+static int needs_stream_info(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx) {
+
+    if (!ctx->metadata_only && !ctx->fast_stream_info) {
+        return TRUE;
+    }
+
+    if (!ctx->metadata_only) {
+        int complete_header = FALSE;
+        for (int i = 0; CompleteHeaderFormats[i] != NULL; i++) {
+            if (strcmp(pFormatCtx->iformat->name, CompleteHeaderFormats[i]) == 0) {
+                complete_header = TRUE;
+                break;
             }
         }
+        if (!complete_header) {
+            return TRUE;
+        }
+    }
+
+    if (pFormatCtx->nb_streams == 0 || (IS_VIDEO(pFormatCtx) && pFormatCtx->duration == AV_NOPTS_VALUE)) {
+        return TRUE;
+    }
+
+    for (int i = 0; i < pFormatCtx->nb_streams; i++) {
+        AVCodecParameters *par = pFormatCtx->streams[i]->codecpar;
+
+        if (par->codec_id == AV_CODEC_ID_NONE) {
+            return TRUE;
+        }
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO && (par->width <= 0 || par->height <= 0)) {
+            return TRUE;
+        }
+        if (par->codec_type == AVMEDIA_TYPE_AUDIO && par->sample_rate <= 0) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static AVCodecContext *open_video_decoder(scan_media_ctx_t *ctx, AVStream *stream) {
+
+    AVCodec *video_codec = avcodec_find_decoder(stream->codecpar->codec_id);
+    if (video_codec == NULL) {
+        return NULL;
+    }
+    AVCodecContext *decoder = avcodec_alloc_context3(video_codec);
+    avcodec_parameters_to_context(decoder, stream->codecpar);
+
+    // Frame threading needs several packets in flight before the first frame comes out,
+    // it is only worth it for expensive codecs
+    if (ctx->decoder_threads > 1) {
+        decoder->thread_count = ctx->decoder_threads;
+        decoder->thread_type = FF_THREAD_FRAME;
     } else {
-        // EXIF metadata
-        while ((tag = av_dict_get(frame->metadata, "", tag, AV_DICT_IGNORE_SUFFIX))) {
-            char key[256];
-            STRCPY_TOLOWER(key, tag->key)
-
-            if (strcmp(key, "artist") == 0) {
-                append_tag_meta_if_not_exists(ctx, doc, tag, MetaArtist);
-            } else if (strcmp(key, "imagedescription") == 0) {
-                APPEND_TAG_META(MetaContent)
-            } else if (strcmp(key, "make") == 0) {
-                APPEND_TAG_META(MetaExifMake)
-            } else if (strcmp(key, "model") == 0) {
-                APPEND_TAG_META(MetaExifModel)
-            } else if (strcmp(key, "software") == 0) {
-                APPEND_TAG_META(MetaExifSoftware)
-            } else if (strcmp(key, "fnumber") == 0) {
-                APPEND_TAG_META(MetaExifFNumber)
-            } else if (strcmp(key, "focallength") == 0) {
-                APPEND_TAG_META(MetaExifFocalLength)
-            } else if (strcmp(key, "usercomment") == 0) {
-                APPEND_TAG_META(MetaExifUserComment)
-            } else if (strcmp(key, "isospeedratings") == 0) {
-                APPEND_TAG_META(MetaExifIsoSpeedRatings)
-            } else if (strcmp(key, "exposuretime") == 0) {
-                APPEND_TAG_META(MetaExifExposureTime)
-            } else if (strcmp(key, "datetime") == 0) {
-                APPEND_TAG_META(MetaExifDateTime)
-            } else if (strcmp(key, "gpslatitude") == 0) {
-                APPEND_TAG_META(MetaExifGpsLatitudeDMS)
-            } else if (strcmp(key, "gpslatituderef") == 0) {
-                APPEND_TAG_META(MetaExifGpsLatitudeRef)
-            } else if (strcmp(key, "gpslongitude") == 0) {
-                APPEND_TAG_META(MetaExifGpsLongitudeDMS)
-            } else if (strcmp(key, "gpslongituderef") == 0) {
-                APPEND_TAG_META(MetaExifGpsLongitudeRef)
+        decoder->thread_count = 1;
+    }
+
+    if (ctx->tn_keyframe_only) {
+        decoder->skip_frame = AVDISCARD_NONKEY;
+    }
+
+    // Let the decoder downscale (JPEG DCT scaling) as long as the frame stays larger than the thumbnail.
+    // Not for inter-coded video (mpeg4, h263...), reduced resolution motion compensation leaves artifacts
+    int max_lowres = stream->codecpar->codec_id == AV_CODEC_ID_MJPEG ? video_codec->max_lowres : 0;
+    int width = stream->codecpar->width;
+    int height = stream->codecpar->height;
+    int max_side = MAX(width, height);
+    for (int lowres = max_lowres; lowres > 0; lowres--) {
+        if (AV_CEIL_RSHIFT(max_side, lowres) >= ctx->tn_size) {
+            decoder->lowres = lowres;
+            break;
+        }
+    }
+
+    if (ctx->tn_max_pixels > 0) {
+        // Downscale further if the frame is still too large to be decoded in memory
+        while (decoder->lowres < max_lowres &&
+               (long) AV_CEIL_RSHIFT(width, decoder->lowres) * AV_CEIL_RSHIFT(height, decoder->lowres)
+               > ctx->tn_max_pixels) {
+            decoder->lowres += 1;
+        }
+
+        if ((long) AV_CEIL_RSHIFT(width, decoder->lowres) * AV_CEIL_RSHIFT(height, decoder->lowres)
+            > ctx->tn_max_pixels) {
+            avcodec_free_context(&decoder);
+            return NULL;
+        }
+
+        // Also enforced by the decoder when the container's dimensions are missing or wrong
+        decoder->max_pixels = ctx->tn_max_pixels << (2 * decoder->lowres);
+    }
+    avcodec_open2(decoder, video_codec, NULL);
+
+    return decoder;
+}
+
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * Thumbnail from tn_frame_count frames at evenly spaced keyframes, as a contact sheet or separate
+ * thumbnails. Uniform (black, single color) frames are replaced by one of the next few frames.
+ */
+static void store_video_frames(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, AVCodecContext *decoder,
+                               int video_stream, int has_exif_meta, document_t *doc) {
+
+    AVStream *stream = pFormatCtx->streams[video_stream];
+    int frame_count = MIN(ctx->tn_frame_count, MAX_TN_FRAMES);
+    int64_t start = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+
+    int sheet = !ctx->tn_frames_separate;
+    if (sheet && !thumbnail_sheet_begin(stream->codecpar->width, stream->codecpar->height, ctx->tn_size,
+                                        frame_count)) {
+        return;
+    }
+
+    struct timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+    int dims[MAX_TN_FRAMES * 2];
+    int stored = 0;
+    int has_frame_meta = IS_VIDEO(pFormatCtx) || has_exif_meta;
+
+    for (int i = 0; i < frame_count; i++) {
+        if (ctx->tn_decode_budget_ms > 0 && elapsed_ms(&start_time) >= ctx->tn_decode_budget_ms) {
+            CTX_LOG_DEBUGF(doc->filepath, "Thumbnail decode budget exceeded after %d/%d frames", i, frame_count)
+            break;
+        }
+
+        // Keyframe before the middle of each of the frame_count segments
+        int64_t ts = start + stream->duration * (2 * i + 1) / (2 * frame_count);
+        if (av_seek_frame(pFormatCtx, video_stream, ts, AVSEEK_FLAG_BACKWARD) < 0) {
+            continue;
+        }
+        avcodec_flush_buffers(decoder);
+
+        for (int attempt = 0; attempt <= TN_UNIFORM_RETRIES; attempt++) {
+            frame_and_packet_t *frame_and_packet = read_frame(ctx, pFormatCtx, decoder, video_stream, doc);
+            if (frame_and_packet == NULL) {
+                break;
+            }
+            AVFrame *frame = frame_and_packet->frame;
+
+            if (!has_frame_meta) {
+                append_frame_exif_meta(ctx, frame, doc);
+                has_frame_meta = TRUE;
+            }
+
+            // Keep the last frame even if it is uniform
+            int skip_uniform = attempt < TN_UNIFORM_RETRIES;
+            int ret;
+
+            if (sheet) {
+                ret = thumbnail_sheet_add((const uint8_t *const *) frame->data, frame->linesize,
+                                          frame->width, frame->height, frame->format, skip_uniform);
+            } else {
+                int dst_w;
+                int dst_h;
+                thumbnail_t tn;
+
+                ret = thumbnail_fit(frame->width, frame->height, ctx->tn_size, &dst_w, &dst_h);
+                if (ret) {
+                    ret = thumbnail_encode((const uint8_t *const *) frame->data, frame->linesize,
+                                           frame->width, frame->height, frame->format, dst_w, dst_h,
+                                           ctx->tn_qscale, ctx->tn_max_bytes, skip_uniform, &tn);
+                }
+                if (ret == TRUE) {
+                    thumbnail_store_index(ctx->store, doc, stored, &tn);
+                    dims[stored * 2] = tn.width;
+                    dims[stored * 2 + 1] = tn.height;
+                    stored += 1;
+                }
+            }
+
+            frame_and_packet_free(frame_and_packet);
+
+            if (ret != THUMBNAIL_UNIFORM) {
+                break;
             }
         }
     }
+
+    if (sheet) {
+        thumbnail_t tn;
+        if (thumbnail_sheet_encode(ctx->tn_qscale, ctx->tn_max_bytes, &tn)) {
+            thumbnail_store(ctx->store, doc, &tn);
+        }
+    } else {
+        thumbnail_append_meta(doc, dims, stored);
+    }
+}
+
+static int png_read_size(const unsigned char *buf, size_t len, int *width, int *height) {
+    static const unsigned char png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+
+    // Signature, then the IHDR chunk: length, type, width, height
+    if (len < 24 || memcmp(buf, png_signature, sizeof(png_signature)) != 0 || memcmp(buf + 12, "IHDR", 4) != 0) {
+        return FALSE;
+    }
+
+    *width = (int) ((uint32_t) buf[16] << 24 | buf[17] << 16 | buf[18] << 8 | buf[19]);
+    *height = (int) ((uint32_t) buf[20] << 24 | buf[21] << 16 | buf[22] << 8 | buf[23]);
+    return TRUE;
 }
 
-void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, document_t *doc) {
+/*
+ * Cover art of audio files: the attached picture is stored as-is if it is a JPEG or PNG that fits
+ * in tn_size, otherwise it is decoded like an image file
+ */
+static void store_attached_pic(scan_media_ctx_t *ctx, const AVStream *stream, document_t *doc) {
+
+    const AVPacket *pic = &stream->attached_pic;
+    if (pic->data == NULL || pic->size <= 0) {
+        return;
+    }
+
+    enum AVCodecID codec_id = stream->codecpar->codec_id;
+    int width = 0;
+    int height = 0;
+
+    if (codec_id == AV_CODEC_ID_MJPEG) {
+        jpeg_header_t header;
+        if (jpeg_read_header(pic->data, pic->size, &header)) {
+            width = header.width;
+            height = header.height;
+        }
+    } else if (codec_id == AV_CODEC_ID_PNG) {
+        png_read_size(pic->data, pic->size, &width, &height);
+    }
+
+    if (width > 0 && height > 0 && width <= ctx->tn_size && height <= ctx->tn_size
+        && ctx->tn_sizes[0] == 0 && !ctx->tn_dhash) {
+        CTX_LOG_DEBUGF(doc->filepath, "Storing attached picture as-is (%dx%d)", width, height)
+        APPEND_TN_META(doc, width, height)
+        ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) pic->data, pic->size);
+        return;
+    }
+
+    store_image_thumbnails(ctx, pic->data, pic->size, doc, codec_id == AV_CODEC_ID_PNG ? "cover.png" : "cover.jpg",
+                           ctx->tn_sizes, ctx->tn_dhash);
+}
+
+void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx, document_t *doc, int has_exif_meta) {
 
     int video_stream = -1;
     int audio_stream = -1;
     int subtitle_stream = -1;
 
-    avformat_find_stream_info(pFormatCtx, NULL);
+    if (needs_stream_info(ctx, pFormatCtx)) {
+        avformat_find_stream_info(pFormatCtx, NULL);
+    } else if (pFormatCtx->bit_rate <= 0 && pFormatCtx->duration > 0 && avio_size(pFormatCtx->pb) > 0) {
+        // Normally computed by avformat_find_stream_info()
+        pFormatCtx->bit_rate = (int64_t) ((double) avio_size(pFormatCtx->pb) * 8.0 * AV_TIME_BASE /
+                                          (double) pFormatCtx->duration);
+    }
 
     for (int i = (int) pFormatCtx->nb_streams - 1; i >= 0; i--) {
         AVStream *stream = pFormatCtx->streams[i];
@@ -390,91 +920,84 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
         }
     }
 
-    if (subtitle_stream != -1 && ctx->read_subtitles) {
-        read_subtitles(ctx, pFormatCtx, subtitle_stream, doc);
+    // Cover art of audio files, its packet is already in memory
+    int attached_pic = video_stream != -1
+                       && (pFormatCtx->streams[video_stream]->disposition & AV_DISPOSITION_ATTACHED_PIC);
 
-        // Reset stream
-        if (video_stream != -1) {
-            av_seek_frame(pFormatCtx, video_stream, 0, 0);
+    AVCodecContext *decoder = NULL;
+    int64_t tn_target = 0;
+
+    if (video_stream != -1 && ctx->tn_size > 0 && !ctx->metadata_only && !attached_pic) {
+        AVStream *stream = pFormatCtx->streams[video_stream];
+
+        if (stream->codecpar->width > MIN_SIZE && stream->codecpar->height > MIN_SIZE) {
+            decoder = open_video_decoder(ctx, stream);
+
+            if (decoder == NULL) {
+                CTX_LOG_DEBUGF(doc->filepath, "Skipping thumbnail of %dx%d frame (no decoder or tn_max_pixels=%ld)",
+                               stream->codecpar->width, stream->codecpar->height, ctx->tn_max_pixels)
+            } else if (stream->nb_frames > 1 && stream->codecpar->codec_id != AV_CODEC_ID_GIF) {
+                tn_target = (int64_t) (stream->duration * 0.10);
+            }
         }
     }
 
+    int contact_sheet = decoder != NULL && tn_target > 0 && ctx->tn_frame_count > 1;
+    frame_and_packet_t *frame_and_packet = NULL;
+
+    if (subtitle_stream != -1 && ctx->read_subtitles && !ctx->metadata_only) {
+        frame_and_packet = read_subtitles(ctx, pFormatCtx, subtitle_stream, video_stream,
+                                          contact_sheet ? NULL : decoder, tn_target, doc);
+    }
+
+    int has_video_meta = video_stream != -1 && IS_VIDEO(pFormatCtx);
+
     if (audio_stream != -1) {
-        append_audio_meta(pFormatCtx, doc);
+        append_audio_meta(pFormatCtx, doc, !has_video_meta);
     }
 
-    if (video_stream != -1 && ctx->tn_size > 0) {
-        AVStream *stream = pFormatCtx->streams[video_stream];
+    // Before the thumbnail, which can fail or be skipped
+    if (has_video_meta) {
+        append_video_meta(ctx, pFormatCtx, doc);
+    }
 
-        if (stream->codecpar->width <= MIN_SIZE || stream->codecpar->height <= MIN_SIZE) {
-            avformat_close_input(&pFormatCtx);
-            avformat_free_context(pFormatCtx);
-            return;
+    if (attached_pic && ctx->tn_size > 0 && !ctx->metadata_only) {
+        store_attached_pic(ctx, pFormatCtx->streams[video_stream], doc);
+    } else if (contact_sheet) {
+        store_video_frames(ctx, pFormatCtx, decoder, video_stream, has_exif_meta, doc);
+        avcodec_free_context(&decoder);
+    } else if (decoder != NULL) {
+        if (frame_and_packet == NULL && subtitle_stream != -1 && ctx->read_subtitles) {
+            // Drop the packets sent while reading the subtitles, they are from before the seek
+            avcodec_flush_buffers(decoder);
         }
 
-        // Decoder
-        AVCodec *video_codec = avcodec_find_decoder(stream->codecpar->codec_id);
-        AVCodecContext *decoder = avcodec_alloc_context3(video_codec);
-        avcodec_parameters_to_context(decoder, stream->codecpar);
-        avcodec_open2(decoder, video_codec, NULL);
-
-        //Seek
-        if (stream->nb_frames > 1 && stream->codecpar->codec_id != AV_CODEC_ID_GIF) {
-            int seek_ret;
-            for (int i = 20; i >= 0; i--) {
-                seek_ret = av_seek_frame(pFormatCtx, video_stream,
-                                         stream->duration * 0.10, 0);
-                if (seek_ret == 0) {
-                    break;
-                }
+        //Seek, unless the thumbnail frame was already decoded while reading the subtitles
+        if (frame_and_packet == NULL && tn_target > 0) {
+            int seek_flags = ctx->tn_keyframe_only ? AVSEEK_FLAG_BACKWARD : 0;
+            if (av_seek_frame(pFormatCtx, video_stream, tn_target, seek_flags) < 0) {
+                av_seek_frame(pFormatCtx, video_stream, tn_target, seek_flags ^ AVSEEK_FLAG_BACKWARD);
             }
+        } else if (frame_and_packet == NULL && subtitle_stream != -1 && ctx->read_subtitles) {
+            av_seek_frame(pFormatCtx, video_stream, 0, 0);
         }
 
-        frame_and_packet_t *frame_and_packet = read_frame(ctx, pFormatCtx, decoder, video_stream, doc);
         if (frame_and_packet == NULL) {
-            avcodec_free_context(&decoder);
-            avformat_close_input(&pFormatCtx);
-            avformat_free_context(pFormatCtx);
-            return;
+            frame_and_packet = read_frame(ctx, pFormatCtx, decoder, video_stream, doc);
         }
-
-        append_video_meta(ctx, pFormatCtx, frame_and_packet->frame, doc, IS_VIDEO(pFormatCtx));
-
-        // Scale frame
-        AVFrame *scaled_frame = scale_frame(decoder, frame_and_packet->frame, ctx->tn_size);
-
-        if (scaled_frame == NULL) {
-            frame_and_packet_free(frame_and_packet);
+        if (frame_and_packet == NULL) {
             avcodec_free_context(&decoder);
             avformat_close_input(&pFormatCtx);
             avformat_free_context(pFormatCtx);
             return;
         }
 
-        if (scaled_frame == STORE_AS_IS) {
-            APPEND_TN_META(doc, frame_and_packet->frame->width, frame_and_packet->frame->height)
-            ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) frame_and_packet->packet->data,
-                       frame_and_packet->packet->size);
-        } else {
-            // Encode frame to jpeg
-            AVCodecContext *jpeg_encoder = alloc_jpeg_encoder(scaled_frame->width, scaled_frame->height,
-                                                              ctx->tn_qscale);
-            avcodec_send_frame(jpeg_encoder, scaled_frame);
-
-            AVPacket jpeg_packet;
-            av_init_packet(&jpeg_packet);
-            avcodec_receive_packet(jpeg_encoder, &jpeg_packet);
-
-            // Save thumbnail
-            APPEND_TN_META(doc, scaled_frame->width, scaled_frame->height)
-            ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) jpeg_packet.data, jpeg_packet.size);
-
-            avcodec_free_context(&jpeg_encoder);
-            av_packet_unref(&jpeg_packet);
-            av_free(*scaled_frame->data);
-            av_frame_free(&scaled_frame);
+        if (!IS_VIDEO(pFormatCtx) && !has_exif_meta) {
+            append_frame_exif_meta(ctx, frame_and_packet->frame, doc);
         }
 
+        store_frame_thumbnail(ctx, decoder, frame_and_packet, ctx->tn_sizes, ctx->tn_max_bytes, ctx->tn_dhash, doc);
+
         frame_and_packet_free(frame_and_packet);
         avcodec_free_context(&decoder);
     }
@@ -483,13 +1006,15 @@ void parse_media_format_ctx(scan_media_ctx_t *ctx, AVFormatContext *pFormatCtx,
     avformat_free_context(pFormatCtx);
 }
 
-void parse_media_filename(scan_media_ctx_t *ctx, const char *filepath, document_t *doc) {
+void parse_media_filename(scan_media_ctx_t *ctx, const char *filepath, document_t *doc, int has_exif_meta) {
 
     AVFormatContext *pFormatCtx = avformat_alloc_context();
     if (pFormatCtx == NULL) {
         CTX_LOG_ERROR(doc->filepath, "(media.c) Could not allocate context with avformat_alloc_context()")
         return;
     }
+    set_probe_options(ctx, pFormatCtx);
+
     int res = avformat_open_input(&pFormatCtx, filepath, NULL, NULL);
     if (res < 0) {
         CTX_LOG_ERRORF(doc->filepath, "(media.c) avformat_open_input() returned [%d] %s", res, av_err2str(res))
@@ -498,18 +1023,226 @@ void parse_media_filename(scan_media_ctx_t *ctx, const char *filepath, document_
         return;
     }
 
-    parse_media_format_ctx(ctx, pFormatCtx, doc);
+    parse_media_format_ctx(ctx, pFormatCtx, doc, has_exif_meta);
 }
 
-int vfile_read(void *ptr, uint8_t *buf, int buf_size) {
-    struct vfile *f = ptr;
+#define VFILE_STREAM_CHUNK_SIZE (1024 * 64)
+
+/*
+ * Seekable view of a vfile that can only be read sequentially (archive members).
+ * Bytes are read from the vfile as ffmpeg needs them and kept so that it can seek
+ * back: the first mem_limit bytes in memory, the rest in an unlinked temporary file.
+ */
+typedef struct {
+    vfile_t *f;
+    document_t *doc;
+    scan_media_ctx_t *ctx;
+
+    long pos;
+    // Number of bytes read from the vfile so far
+    long fetched;
+    int eof;
+    // The bytes could not be kept, nothing more can be read
+    int failed;
+
+    // Checksum of every byte returned by f->read(), including the ones of the rewind buffer
+    SHA_CTX sha1_ctx;
+
+    unsigned char *mem;
+    long mem_size;
+    long mem_limit;
+
+    int spill_fd;
+    unsigned char *chunk;
+} vfile_stream_t;
+
+static void vfile_stream_init(scan_media_ctx_t *ctx, vfile_t *f, document_t *doc, vfile_stream_t *s) {
+    memset(s, 0, sizeof(vfile_stream_t));
+    s->ctx = ctx;
+    s->f = f;
+    s->doc = doc;
+    s->spill_fd = -1;
+    s->mem_limit = ctx->max_media_buffer;
+    if (f->info.st_size > 0) {
+        s->mem_limit = MIN(s->mem_limit, f->info.st_size);
+    }
+    s->chunk = malloc(VFILE_STREAM_CHUNK_SIZE);
+
+    if (f->calculate_checksum) {
+        SHA1_Init(&s->sha1_ctx);
+    }
+}
 
-    int ret = f->read(f, buf, buf_size);
+static int vfile_stream_open_spill(vfile_stream_t *s) {
+    scan_media_ctx_t *ctx = s->ctx;
 
-    if (ret == 0) {
+    const char *tmp_dir = ctx->tmp_path[0] != '\0' ? ctx->tmp_path : getenv("TMPDIR");
+    if (tmp_dir == NULL) {
+        tmp_dir = "/tmp";
+    }
+
+    char template[PATH_MAX];
+    snprintf(template, sizeof(template), "%s/libscan-media-XXXXXX", tmp_dir);
+
+    s->spill_fd = mkstemp(template);
+    if (s->spill_fd == -1) {
+        CTX_LOG_ERRORF(s->doc->filepath, "(media.c) Could not create temporary file in %s: %s", tmp_dir, strerror(errno))
+        return FALSE;
+    }
+    unlink(template);
+
+    CTX_LOG_DEBUGF(s->doc->filepath, "Media file is larger than %ldB, spilling to temporary file", s->mem_limit)
+    return TRUE;
+}
+
+static int vfile_stream_store(vfile_stream_t *s, const unsigned char *buf, long len) {
+    scan_media_ctx_t *ctx = s->ctx;
+
+    if (s->f->calculate_checksum) {
+        safe_sha1_update(&s->sha1_ctx, (unsigned char *) buf, len);
+    }
+    if (s->failed) {
+        // Only hashed
+        return FALSE;
+    }
+
+    if (s->fetched < s->mem_limit) {
+        long mem_len = MIN(len, s->mem_limit - s->fetched);
+
+        if (s->fetched + mem_len > s->mem_size) {
+            long mem_size = MIN(MAX(s->mem_size * 2, s->fetched + mem_len), s->mem_limit);
+            unsigned char *mem = realloc(s->mem, mem_size);
+
+            if (mem == NULL) {
+                // Nothing was spilled yet: keep what is in memory and spill the rest
+                CTX_LOG_WARNINGF(s->doc->filepath, "(media.c) Could not allocate %ldB, spilling to temporary file",
+                                 mem_size)
+                s->mem_limit = s->fetched;
+                mem_len = 0;
+            } else {
+                s->mem = mem;
+                s->mem_size = mem_size;
+            }
+        }
+        if (mem_len > 0) {
+            memcpy(s->mem + s->fetched, buf, mem_len);
+        }
+
+        s->fetched += mem_len;
+        buf += mem_len;
+        len -= mem_len;
+    }
+
+    if (len > 0) {
+        if (s->spill_fd == -1 && !vfile_stream_open_spill(s)) {
+            return FALSE;
+        }
+        if (pwrite(s->spill_fd, buf, len, s->fetched - s->mem_limit) != len) {
+            CTX_LOG_ERRORF(s->doc->filepath, "(media.c) Could not write to temporary file: %s", strerror(errno))
+            return FALSE;
+        }
+        s->fetched += len;
+    }
+
+    return TRUE;
+}
+
+static void vfile_stream_fetch(vfile_stream_t *s, long until) {
+    while (!s->eof && !s->failed && s->fetched < until) {
+        int ret = s->f->read(s->f, s->chunk, VFILE_STREAM_CHUNK_SIZE);
+        if (ret <= 0) {
+            s->eof = TRUE;
+        } else if (!vfile_stream_store(s, s->chunk, ret)) {
+            s->failed = TRUE;
+        }
+    }
+}
+
+int vfile_stream_read(void *ptr, uint8_t *buf, int buf_size) {
+    vfile_stream_t *s = ptr;
+
+    vfile_stream_fetch(s, s->pos + buf_size);
+
+    long len = MIN(buf_size, s->fetched - s->pos);
+    if (len <= 0) {
         return AVERROR_EOF;
     }
-    return ret;
+
+    long copied = 0;
+    if (s->pos < s->mem_limit) {
+        copied = MIN(len, s->mem_limit - s->pos);
+        memcpy(buf, s->mem + s->pos, copied);
+    }
+    if (copied < len) {
+        ssize_t ret = pread(s->spill_fd, buf + copied, len - copied, s->pos + copied - s->mem_limit);
+        if (ret != len - copied) {
+            return AVERROR(EIO);
+        }
+    }
+
+    s->pos += len;
+    return (int) len;
+}
+
+int64_t vfile_stream_seek(void *ptr, int64_t offset, int whence) {
+    vfile_stream_t *s = ptr;
+    long size = s->f->info.st_size;
+
+    if (whence == AVSEEK_SIZE) {
+        return size > 0 ? size : AVERROR(ENOSYS);
+    }
+
+    long pos;
+    switch (whence & ~AVSEEK_FORCE) {
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = s->pos + offset;
+            break;
+        case SEEK_END:
+            if (size <= 0) {
+                return AVERROR(ENOSYS);
+            }
+            pos = size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+
+    if (pos < 0) {
+        return AVERROR(EINVAL);
+    }
+    s->pos = pos;
+    return pos;
+}
+
+static void vfile_stream_close(vfile_stream_t *s) {
+    vfile_t *f = s->f;
+
+    if (f->calculate_checksum) {
+        // The checksum covers the whole file, even the parts that ffmpeg did not need or that could not be kept
+        s->failed = TRUE;
+        while (!s->eof) {
+            int ret = f->read(f, s->chunk, VFILE_STREAM_CHUNK_SIZE);
+            if (ret <= 0) {
+                s->eof = TRUE;
+            } else {
+                vfile_stream_store(s, s->chunk, ret);
+            }
+        }
+
+        // arc_read() does not hash the rewind buffer, replace its checksum. arc_close() finalizes it again.
+        f->sha1_ctx = s->sha1_ctx;
+        SHA1_Final(f->sha1_digest, &s->sha1_ctx);
+        f->has_checksum = TRUE;
+    }
+
+    free(s->mem);
+    free(s->chunk);
+    if (s->spill_fd != -1) {
+        close(s->spill_fd);
+    }
 }
 
 typedef struct {
@@ -545,27 +1278,6 @@ long memfile_seek(void *ptr, long offset, int whence) {
     return ftell(mem->file);
 }
 
-int memfile_open(vfile_t *f, memfile_t *mem) {
-    mem->size = f->info.st_size;
-
-    mem->buf = malloc(mem->size);
-    if (mem->buf == NULL) {
-        return -1;
-    }
-
-    int ret = f->read(f, mem->buf, mem->size);
-    mem->file = fmemopen(mem->buf, mem->size, "rb");
-
-    if (f->calculate_checksum) {
-        SHA1_Init(&f->sha1_ctx);
-        safe_sha1_update(&f->sha1_ctx, mem->buf, mem->size);
-        SHA1_Final(f->sha1_digest, &f->sha1_ctx);
-        f->has_checksum = TRUE;
-    }
-
-    return (ret == mem->size && mem->file != NULL) ? 0 : -1;
-}
-
 int memfile_open_buf(void *buf, size_t buf_len, memfile_t *mem) {
     mem->size = (int) buf_len;
 
@@ -575,65 +1287,75 @@ int memfile_open_buf(void *buf, size_t buf_len, memfile_t *mem) {
     return mem->file != NULL ? 0 : -1;
 }
 
-void memfile_close(memfile_t *mem) {
-    if (mem->buf != NULL) {
-        free(mem->buf);
-        fclose(mem->file);
-    }
-}
-
 void parse_media_vfile(scan_media_ctx_t *ctx, struct vfile *f, document_t *doc, const char *mime_str) {
 
-    AVFormatContext *pFormatCtx = avformat_alloc_context();
-    if (pFormatCtx == NULL) {
-        CTX_LOG_ERROR(doc->filepath, "(media.c) Could not allocate context with avformat_alloc_context()")
-        return;
-    }
-
-    unsigned char *buffer = (unsigned char *) av_malloc(AVIO_BUF_SIZE);
-    AVIOContext *io_ctx = NULL;
-    memfile_t memfile = {0, 0, 0};
+    vfile_stream_t stream;
+    vfile_stream_init(ctx, f, doc, &stream);
 
     const char *filepath = get_filepath_with_ext(doc, f->filepath, mime_str);
+    int exif = EXIF_NOT_PARSED;
 
-    if (f->info.st_size <= ctx->max_media_buffer) {
-        int ret = memfile_open(f, &memfile);
-        if (ret == 0) {
-            CTX_LOG_DEBUGF(f->filepath, "Loading media file in memory (%ldB)", f->info.st_size)
-            io_ctx = avio_alloc_context(buffer, AVIO_BUF_SIZE, 0, &memfile, memfile_read, NULL, memfile_seek);
+    if (IS_EXIF_MIME(mime_str)) {
+        unsigned char *header = malloc(EXIF_HEADER_SIZE);
+        int len = vfile_stream_read(&stream, header, EXIF_HEADER_SIZE);
+        if (len > 0) {
+            exif = parse_exif_image(ctx, header, len, doc, mime_str);
+        }
+        free(header);
+        stream.pos = 0;
+
+        if (exif == EXIF_PARSED_ALL) {
+            vfile_stream_close(&stream);
+            return;
         }
     }
 
-    if (io_ctx == NULL) {
-        CTX_LOG_DEBUGF(f->filepath, "Reading media file without seek support", f->info.st_size)
-        io_ctx = avio_alloc_context(buffer, AVIO_BUF_SIZE, 0, f, vfile_read, NULL, NULL);
+    AVFormatContext *pFormatCtx = avformat_alloc_context();
+    if (pFormatCtx == NULL) {
+        CTX_LOG_ERROR(doc->filepath, "(media.c) Could not allocate context with avformat_alloc_context()")
+        vfile_stream_close(&stream);
+        return;
     }
 
+    unsigned char *buffer = (unsigned char *) av_malloc(AVIO_BUF_SIZE);
+    AVIOContext *io_ctx = avio_alloc_context(buffer, AVIO_BUF_SIZE, 0, &stream, vfile_stream_read, NULL,
+                                             vfile_stream_seek);
+
     pFormatCtx->pb = io_ctx;
 
+    set_probe_options(ctx, pFormatCtx);
+
     int res = avformat_open_input(&pFormatCtx, filepath, NULL, NULL);
     if (res < 0) {
         if (res != -5) {
             CTX_LOG_ERRORF(doc->filepath, "(media.c) avformat_open_input() returned [%d] %s", res, av_err2str(res))
         }
         av_free(io_ctx->buffer);
-        memfile_close(&memfile);
         avio_context_free(&io_ctx);
         avformat_close_input(&pFormatCtx);
         avformat_free_context(pFormatCtx);
+        vfile_stream_close(&stream);
         return;
     }
 
-    parse_media_format_ctx(ctx, pFormatCtx, doc);
+    parse_media_format_ctx(ctx, pFormatCtx, doc, exif == EXIF_PARSED_META);
     av_free(io_ctx->buffer);
     avio_context_free(&io_ctx);
-    memfile_close(&memfile);
+    vfile_stream_close(&stream);
 }
 
 void parse_media(scan_media_ctx_t *ctx, vfile_t *f, document_t *doc, const char *mime_str) {
 
     if (f->is_fs_file) {
-        parse_media_filename(ctx, f->filepath, doc);
+        if (ctx->fast_audio_tags && strncmp(mime_str, "audio/", 6) == 0 && parse_audio_tags_file(ctx, f, doc)) {
+            return;
+        }
+
+        int exif = IS_EXIF_MIME(mime_str) ? parse_exif_image_file(ctx, f->filepath, doc, mime_str) : EXIF_NOT_PARSED;
+        if (exif == EXIF_PARSED_ALL) {
+            return;
+        }
+        parse_media_filename(ctx, f->filepath, doc, exif == EXIF_PARSED_META);
     } else {
         parse_media_vfile(ctx, f, doc, mime_str);
     }
@@ -641,9 +1363,19 @@ void parse_media(scan_media_ctx_t *ctx, vfile_t *f, document_t *doc, const char
 
 void init_media() {
     av_log_set_level(AV_LOG_QUIET);
+
+    if (!media_tag_table_check()) {
+        fprintf(stderr, "(media.c) Tag lookup table is not a perfect hash, update tag_key_hash()\n");
+        exit(-1);
+    }
 }
 
 int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, document_t *doc, const char *url) {
+    return store_image_thumbnails(ctx, buf, buf_len, doc, url, NULL, FALSE);
+}
+
+int store_image_thumbnails(scan_media_ctx_t *ctx, void *buf, size_t buf_len, document_t *doc, const char *url,
+                           const int *tn_sizes, int dhash) {
     memfile_t memfile = {0, 0, 0};
     AVIOContext *io_ctx = NULL;
 
@@ -697,43 +1429,8 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
         return FALSE;
     }
 
-    // Scale frame
-    AVFrame *scaled_frame = scale_frame(decoder, frame_and_packet->frame, ctx->tn_size);
-
-    if (scaled_frame == NULL) {
-        frame_and_packet_free(frame_and_packet);
-        avcodec_free_context(&decoder);
-        avformat_close_input(&pFormatCtx);
-        avformat_free_context(pFormatCtx);
-        av_free(io_ctx->buffer);
-        avio_context_free(&io_ctx);
-        fclose(memfile.file);
-        return FALSE;
-    }
-
-    if (scaled_frame == STORE_AS_IS) {
-        APPEND_TN_META(doc, frame_and_packet->frame->width, frame_and_packet->frame->height)
-        ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) frame_and_packet->packet->data,
-                   frame_and_packet->packet->size);
-    } else {
-        // Encode frame to jpeg
-        AVCodecContext *jpeg_encoder = alloc_jpeg_encoder(scaled_frame->width, scaled_frame->height,
-                                                          ctx->tn_qscale);
-        avcodec_send_frame(jpeg_encoder, scaled_frame);
-
-        AVPacket jpeg_packet;
-        av_init_packet(&jpeg_packet);
-        avcodec_receive_packet(jpeg_encoder, &jpeg_packet);
-
-        // Save thumbnail
-        APPEND_TN_META(doc, scaled_frame->width, scaled_frame->height)
-        ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) jpeg_packet.data, jpeg_packet.size);
-
-        av_packet_unref(&jpeg_packet);
-        avcodec_free_context(&jpeg_encoder);
-        av_free(*scaled_frame->data);
-        av_frame_free(&scaled_frame);
-    }
+    // ctx may be another module's context, only the fields up to tn_qscale can be used
+    ret = store_frame_thumbnail(ctx, decoder, frame_and_packet, tn_sizes, 0, dhash, doc);
 
     frame_and_packet_free(frame_and_packet);
     avcodec_free_context(&decoder);
@@ -745,5 +1442,5 @@ int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, docu
     avio_context_free(&io_ctx);
     fclose(memfile.file);
 
-    return TRUE;
+    return ret;
 }
@@ -3,6 +3,7 @@
 
 
 #include "../scan.h"
+#include "../thumbnail/thumbnail.h"
 
 #include "libavformat/avformat.h"
 #include "libswscale/swscale.h"
@@ -17,36 +18,73 @@ typedef struct {
 
     int tn_size;
     float tn_qscale;
+    // Bytes of an archived media file kept in memory, the rest is spilled to a temporary file
     long max_media_buffer;
+    // Directory for temporary files, empty for $TMPDIR or /tmp
+    char tmp_path[PATH_MAX];
     int read_subtitles;
-} scan_media_ctx_t;
-
-__always_inline
-static AVCodecContext *alloc_jpeg_encoder(int w, int h, float qscale) {
+    // Read every subtitle stream instead of only the first one
+    int read_all_subtitle_streams;
+    // Stop reading subtitles after this many bytes of the file (0 for no limit)
+    long max_subtitle_bytes;
+    // Seek to the keyframe before the thumbnail position and only decode keyframes
+    int tn_keyframe_only;
+    // Video decoder threads: 0 or 1 for single-threaded decoding, N > 1 for frame threading
+    int decoder_threads;
+    // Also accept embedded EXIF thumbnails smaller than tn_size, down to this size (0 to disable)
+    int tn_exif_min_size;
 
-    const AVCodec *jpeg_codec = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
-    AVCodecContext *jpeg = avcodec_alloc_context3(jpeg_codec);
-    jpeg->width = w;
-    jpeg->height = h;
-    jpeg->time_base.den = 1000000;
-    jpeg->time_base.num = 1;
-    jpeg->i_quant_factor = qscale;
+    // Maximum number of bytes read to detect the format and the stream parameters (0 for ffmpeg's default)
+    long probe_size;
+    // Maximum duration analyzed by avformat_find_stream_info(), in AV_TIME_BASE units (0 for ffmpeg's default)
+    long max_analyze_duration;
+    // Trust the container header of formats that have complete stream parameters
+    int fast_stream_info;
+    // Only read codecs, dimensions, duration and tags, without opening decoders
+    int metadata_only;
+    // Read the tags of MP3, FLAC, Ogg and MP4 audio files from their headers instead of opening them with ffmpeg,
+    // unless the cover art is needed for the thumbnail
+    int fast_audio_tags;
+    // Lower the quality of video and image thumbnails until they fit in this many bytes (0 for no limit)
+    size_t tn_max_bytes;
+    // Smaller thumbnails also stored with each tn_size thumbnail, 0-terminated (see thumbnail_store_sizes())
+    int tn_sizes[THUMBNAIL_MAX_SIZES];
+    // Append the difference hash of the thumbnail (MetaThumbnailDHash) to find near-duplicate images
+    int tn_dhash;
 
-    jpeg->pix_fmt = AV_PIX_FMT_YUVJ420P;
-    int ret = avcodec_open2(jpeg, jpeg_codec, NULL);
+    // Number of video frames in the thumbnail, taken at evenly spaced keyframes (0 or 1 for a single frame)
+    int tn_frame_count;
+    // Store the frames as separate thumbnails (see thumbnail_store_index()) instead of a contact sheet
+    int tn_frames_separate;
+    // Stop decoding thumbnail frames after this many milliseconds (0 for no limit)
+    long tn_decode_budget_ms;
+    // Skip the thumbnail of frames with more pixels than this (0 for no limit), JPEG images are
+    // decoded at a reduced scale to stay under the limit when possible
+    long tn_max_pixels;
+} scan_media_ctx_t;
 
-    if (ret != 0) {
-        return NULL;
-    }
+void parse_media(scan_media_ctx_t *ctx, vfile_t *f, document_t *doc, const char*mime_str);
 
-    return jpeg;
-}
+void init_media();
 
+// Metadata dictionaries of media_tag_key()
+#define TAG_AUDIO 1
+#define TAG_VIDEO 2
+#define TAG_EXIF 4
 
-void parse_media(scan_media_ctx_t *ctx, vfile_t *f, document_t *doc, const char*mime_str);
+/**
+ * Case-insensitive lookup of an ffmpeg tag name, 0 if the tag is not read from this source (TAG_* flag)
+ */
+enum metakey media_tag_key(const char *name, int source);
 
-void init_media();
+/**
+ * TRUE if every tag of the lookup table is in the slot of its hash, checked by init_media()
+ */
+int media_tag_table_check();
 
 int store_image_thumbnail(scan_media_ctx_t *ctx, void *buf, size_t buf_len, document_t *doc, const char *url);
 
+int store_image_thumbnails(scan_media_ctx_t *ctx, void *buf, size_t buf_len, document_t *doc, const char *url,
+                           const int *tn_sizes, int dhash);
+
 #endif
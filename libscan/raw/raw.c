@@ -5,106 +5,105 @@
 #include <unistd.h>
 
 
-#define MIN_SIZE 32
-
 int store_thumbnail_jpeg(scan_raw_ctx_t *ctx, libraw_processed_image_t *img, document_t *doc) {
-    return store_image_thumbnail((scan_media_ctx_t *) ctx, img->data, img->data_size, doc, "x.jpeg");
+    return store_image_thumbnails((scan_media_ctx_t *) ctx, img->data, img->data_size, doc, "x.jpeg", ctx->tn_sizes,
+                                  ctx->tn_dhash);
 }
 
-int store_thumbnail_rgb24(scan_raw_ctx_t *ctx, libraw_processed_image_t *img, document_t *doc) {
-
-    int dstW;
-    int dstH;
-
-    if (img->width <= ctx->tn_size && img->height <= ctx->tn_size) {
-        dstW = img->width;
-        dstH = img->height;
-    } else {
-        double ratio = (double) img->width / img->height;
-        if (img->width > img->height) {
-            dstW = ctx->tn_size;
-            dstH = (int) (ctx->tn_size / ratio);
-        } else {
-            dstW = (int) (ctx->tn_size * ratio);
-            dstH = ctx->tn_size;
-        }
-    }
-
-    if (dstW <= MIN_SIZE || dstH <= MIN_SIZE) {
-        return FALSE;
-    }
-
-    AVFrame *scaled_frame = av_frame_alloc();
+int store_thumbnail_rgb24(scan_raw_ctx_t *ctx, const uint8_t *data, int width, int height, document_t *doc) {
 
-    struct SwsContext *sws_ctx = sws_getContext(
-            img->width, img->height, AV_PIX_FMT_RGB24,
-            dstW, dstH, AV_PIX_FMT_YUVJ420P,
-            SIST_SWS_ALGO, 0, 0, 0
-    );
+    const uint8_t *in_data[1] = {data};
+    int in_line_size[1] = {3 * width};
 
-    int dst_buf_len = av_image_get_buffer_size(AV_PIX_FMT_YUV420P, dstW, dstH, 1);
-    uint8_t *dst_buf = (uint8_t *) av_malloc(dst_buf_len);
-
-    av_image_fill_arrays(scaled_frame->data, scaled_frame->linesize, dst_buf, AV_PIX_FMT_YUV420P, dstW, dstH, 1);
-
-    const uint8_t *in_data[1] = {img->data};
-    int in_line_size[1] = {3 * img->width};
-
-    sws_scale(sws_ctx,
-              in_data, in_line_size,
-              0, img->height,
-              scaled_frame->data, scaled_frame->linesize
-    );
-
-    scaled_frame->width = dstW;
-    scaled_frame->height = dstH;
-    scaled_frame->format = AV_PIX_FMT_YUV420P;
+    return thumbnail_store_sizes(ctx->store, doc, in_data, in_line_size, width, height, AV_PIX_FMT_RGB24,
+                                 ctx->tn_size, ctx->tn_sizes, 1.0f, 0, ctx->tn_dhash) > 0;
+}
 
-    sws_freeContext(sws_ctx);
+// libraw handle of this thread, recycled between files to keep its buffers
+static __thread libraw_data_t *thread_libraw = NULL;
+// Processed image of this thread, grown as needed
+static __thread unsigned char *thread_img_buf = NULL;
+static __thread size_t thread_img_buf_size = 0;
+static __thread raw_reuse_stats_t thread_stats = {0, 0};
 
-    AVCodecContext *jpeg_encoder = alloc_jpeg_encoder(scaled_frame->width, scaled_frame->height, 1.0f);
-    avcodec_send_frame(jpeg_encoder, scaled_frame);
+static libraw_data_t *raw_handle_get() {
+    if (thread_libraw == NULL) {
+        thread_libraw = libraw_init(0);
+    } else {
+        thread_stats.handle_reuse += 1;
+    }
+    return thread_libraw;
+}
 
-    AVPacket jpeg_packet;
-    av_init_packet(&jpeg_packet);
-    avcodec_receive_packet(jpeg_encoder, &jpeg_packet);
+static void raw_handle_release(libraw_data_t *libraw_lib) {
+    // libraw_recycle() keeps the processing parameters
+    libraw_lib->params.half_size = 0;
+    libraw_lib->params.user_qual = -1;
+    libraw_recycle(libraw_lib);
+}
 
-    APPEND_TN_META(doc, scaled_frame->width, scaled_frame->height)
-    ctx->store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) jpeg_packet.data, jpeg_packet.size);
+/**
+ * Copy the processed image to the RGB24 buffer of this thread
+ */
+static unsigned char *raw_copy_image(libraw_data_t *libraw_lib, int *width, int *height) {
+    int colors, bps;
+    libraw_get_mem_image_format(libraw_lib, width, height, &colors, &bps);
+    if (colors != 3 || bps != 8 || *width <= 0 || *height <= 0) {
+        return NULL;
+    }
 
-    av_packet_unref(&jpeg_packet);
-    av_free(*scaled_frame->data);
-    av_frame_free(&scaled_frame);
-    avcodec_free_context(&jpeg_encoder);
+    size_t size = (size_t) *width * *height * 3;
+    if (size > thread_img_buf_size) {
+        free(thread_img_buf);
+        thread_img_buf = malloc(size);
+        if (thread_img_buf == NULL) {
+            thread_img_buf_size = 0;
+            return NULL;
+        }
+        thread_img_buf_size = size;
+    } else {
+        thread_stats.buffer_reuse += 1;
+    }
 
-    return TRUE;
+    if (libraw_copy_mem_image(libraw_lib, thread_img_buf, *width * 3, FALSE) != LIBRAW_SUCCESS) {
+        return NULL;
+    }
+    return thread_img_buf;
 }
 
-#define DMS_REF(ref) (((ref) == 'S' || (ref) == 'W') ? -1 : 1)
-
-void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc) {
-    libraw_data_t *libraw_lib = libraw_init(0);
+/**
+ * Unpack the embedded preview used for the thumbnail: the smallest JPEG preview that is
+ * at least tn_size, the largest one otherwise
+ */
+static int raw_unpack_thumb(scan_raw_ctx_t *ctx, libraw_data_t *libraw_lib) {
+#if LIBRAW_COMPILE_CHECK_VERSION_NOTLESS(0, 21)
+    const libraw_thumbnail_list_t *list = &libraw_lib->thumbs_list;
+    int best = -1;
+    int best_size = 0;
+
+    for (int i = 0; i < list->thumbcount; i++) {
+        const libraw_thumbnail_item_t *item = &list->thumblist[i];
+        if (item->tformat != LIBRAW_INTERNAL_THUMBNAIL_JPEG) {
+            continue;
+        }
 
-    if (!libraw_lib) {
-        CTX_LOG_ERROR("raw.c", "Cannot create libraw handle")
-        return;
+        int size = MAX(item->twidth, item->theight);
+        if (best == -1 || (best_size < ctx->tn_size ? size > best_size : size >= ctx->tn_size && size < best_size)) {
+            best = i;
+            best_size = size;
+        }
     }
 
-    size_t buf_len = 0;
-    void *buf = read_all(f, &buf_len);
-    if (buf == NULL) {
-        CTX_LOG_ERROR(f->filepath, "read_all() failed")
-        return;
+    if (best != -1) {
+        return libraw_unpack_thumb_ex(libraw_lib, best);
     }
+#endif
+    return libraw_unpack_thumb(libraw_lib);
+}
 
-    int ret = libraw_open_buffer(libraw_lib, buf, buf_len);
-    if (ret != 0) {
-        CTX_LOG_ERROR(f->filepath, "Could not open raw file")
-        free(buf);
-        libraw_close(libraw_lib);
-        return;
-    }
+#define DMS_REF(ref) (((ref) == 'S' || (ref) == 'W') ? -1 : 1)
 
+static void raw_append_meta(libraw_data_t *libraw_lib, document_t *doc) {
     if (*libraw_lib->idata.model != '\0') {
         APPEND_STR_META(doc, MetaExifModel, libraw_lib->idata.model)
     }
@@ -156,63 +155,102 @@ void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc) {
     }
 
     APPEND_STR_META(doc, MetaMediaVideoCodec, "raw")
+}
 
-    if (ctx->tn_size <= 0) {
-        free(buf);
-        libraw_close(libraw_lib);
+static void raw_store_thumbnail(scan_raw_ctx_t *ctx, vfile_t *f, libraw_data_t *libraw_lib, document_t *doc) {
+    int tn_ok = FALSE;
+    if (raw_unpack_thumb(ctx, libraw_lib) == LIBRAW_SUCCESS) {
+        int errc = 0;
+        libraw_processed_image_t *thumb = libraw_dcraw_make_mem_thumb(libraw_lib, &errc);
+
+        if (errc == 0) {
+            if (libraw_lib->thumbnail.tformat == LIBRAW_THUMBNAIL_JPEG) {
+                tn_ok = store_thumbnail_jpeg(ctx, thumb, doc);
+            } else if (libraw_lib->thumbnail.tformat == LIBRAW_THUMBNAIL_BITMAP) {
+                // TODO: technically this should work but is currently untested
+                tn_ok = store_thumbnail_rgb24(ctx, thumb->data, thumb->width, thumb->height, doc);
+            }
+        }
+        libraw_dcraw_clear_mem(thumb);
+    }
+
+    if (tn_ok == TRUE) {
         return;
     }
 
-    libraw_unpack_thumb(libraw_lib);
+    // No usable preview: the thumbnail is much smaller than the image, decode it at half
+    // size with linear interpolation instead of the full resolution AHD demosaicing
+    libraw_lib->params.half_size = 1;
+    libraw_lib->params.user_qual = 0;
 
-    int errc = 0;
-    libraw_processed_image_t *thumb = libraw_dcraw_make_mem_thumb(libraw_lib, &errc);
-    if (errc != 0) {
-        free(buf);
-        libraw_dcraw_clear_mem(thumb);
-        libraw_close(libraw_lib);
+    if (libraw_unpack(libraw_lib) != 0) {
+        CTX_LOG_ERROR(f->filepath, "Could not unpack raw file")
         return;
     }
 
-    int tn_ok = 0;
-    if (libraw_lib->thumbnail.tformat == LIBRAW_THUMBNAIL_JPEG) {
-        tn_ok = store_thumbnail_jpeg(ctx, thumb, doc);
-    } else if (libraw_lib->thumbnail.tformat == LIBRAW_THUMBNAIL_BITMAP) {
-        // TODO: technically this should work but is currently untested
-        tn_ok = store_thumbnail_rgb24(ctx, thumb, doc);
+    libraw_dcraw_process(libraw_lib);
+
+    int width, height;
+    unsigned char *img = raw_copy_image(libraw_lib, &width, &height);
+    if (img != NULL) {
+        store_thumbnail_rgb24(ctx, img, width, height, doc);
     }
+}
 
-    libraw_dcraw_clear_mem(thumb);
+void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc) {
+    libraw_data_t *libraw_lib = raw_handle_get();
 
-    if (tn_ok == TRUE) {
-        free(buf);
-        libraw_close(libraw_lib);
+    if (!libraw_lib) {
+        CTX_LOG_ERROR("raw.c", "Cannot create libraw handle")
         return;
     }
 
-    ret = libraw_unpack(libraw_lib);
-    if (ret != 0) {
-        CTX_LOG_ERROR(f->filepath, "Could not unpack raw file")
-        free(buf);
-        libraw_close(libraw_lib);
-        return;
+    void *buf = NULL;
+    int ret;
+
+    if (f->is_fs_file) {
+        // libraw seeks to the parts of the file it needs (only the headers when there is no thumbnail)
+        ret = libraw_open_file(libraw_lib, f->filepath);
+    } else {
+        // Archive entries can't be read out of order, load them in memory
+        size_t buf_len = 0;
+        buf = read_all(f, &buf_len);
+        if (buf == NULL) {
+            CTX_LOG_ERROR(f->filepath, "read_all() failed")
+            return;
+        }
+        ret = libraw_open_buffer(libraw_lib, buf, buf_len);
     }
 
-    libraw_dcraw_process(libraw_lib);
+    if (ret != 0) {
+        CTX_LOG_ERROR(f->filepath, "Could not open raw file")
+    } else {
+        raw_append_meta(libraw_lib, doc);
 
-    errc = 0;
-    libraw_processed_image_t *img = libraw_dcraw_make_mem_image(libraw_lib, &errc);
-    if (errc != 0) {
-        free(buf);
-        libraw_dcraw_clear_mem(img);
-        libraw_close(libraw_lib);
-        return;
+        if (ctx->tn_size > 0) {
+            raw_store_thumbnail(ctx, f, libraw_lib, doc);
+        }
     }
 
-    store_thumbnail_rgb24(ctx, img, doc);
+    raw_handle_release(libraw_lib);
+    free(buf);
 
-    libraw_dcraw_clear_mem(img);
-    libraw_close(libraw_lib);
+    if (f->is_fs_file && f->calculate_checksum) {
+        // libraw did not go through f->read()
+        vfile_read_to_end(f);
+    }
+}
 
-    free(buf);
+raw_reuse_stats_t raw_reuse_stats() {
+    return thread_stats;
+}
+
+void cleanup_raw() {
+    if (thread_libraw != NULL) {
+        libraw_close(thread_libraw);
+        thread_libraw = NULL;
+    }
+    free(thread_img_buf);
+    thread_img_buf = NULL;
+    thread_img_buf_size = 0;
 }
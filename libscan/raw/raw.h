@@ -2,6 +2,7 @@
 #define SIST2_RAW_H
 
 #include "../scan.h"
+#include "../thumbnail/thumbnail.h"
 
 typedef struct {
     log_callback_t log;
@@ -10,8 +11,29 @@ typedef struct {
 
     int tn_size;
     float tn_qscale;
+    // Smaller thumbnails also stored, 0-terminated (see thumbnail_store_sizes())
+    int tn_sizes[THUMBNAIL_MAX_SIZES];
+    // Append the difference hash of the thumbnail (MetaThumbnailDHash)
+    int tn_dhash;
 } scan_raw_ctx_t;
 
+typedef struct {
+    // Files opened with the recycled libraw handle of the thread
+    unsigned long handle_reuse;
+    // Processed images copied to the existing buffer of the thread
+    unsigned long buffer_reuse;
+} raw_reuse_stats_t;
+
 void parse_raw(scan_raw_ctx_t *ctx, vfile_t *f, document_t *doc);
 
+/**
+ * Reuse counters of the calling thread
+ */
+raw_reuse_stats_t raw_reuse_stats();
+
+/**
+ * Free the libraw handle and buffers of the calling thread
+ */
+void cleanup_raw();
+
 #endif //SIST2_RAW_H
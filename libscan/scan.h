@@ -88,8 +88,22 @@ enum metakey {
     MetaExifGpsLatitudeRef,
     MetaExifGpsLatitudeDec,
     MetaExifGpsLongitudeDec,
+
+    // New keys are appended so that the values above don't change
+    MetaLanguage,
+    MetaEstimatedContentSize,
+    MetaThumbnailDHash,
+
+    // Not a key, new keys go above
+    MetaKeyEnd,
 };
 
+#ifndef __cplusplus
+_Static_assert(MetaKeyEnd <= 64, "document_t.meta_keys has one bit per metakey");
+#endif
+
+#define HAS_META_KEY(doc, key) ((doc)->meta_head != NULL && (doc)->meta_keys & (1ULL << (key)))
+
 typedef struct meta_line {
     struct meta_line *next;
     enum metakey key;
@@ -111,6 +125,8 @@ typedef struct document {
     char has_parent;
     meta_line_t *meta_head;
     meta_line_t *meta_tail;
+    // Bit (1 << key) set for each key in the meta list, only valid when meta_head != NULL
+    unsigned long long meta_keys;
     char *filepath;
 } document_t;
 
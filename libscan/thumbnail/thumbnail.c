@@ -0,0 +1,568 @@
+#include "thumbnail.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <math.h>
+#include <jpeglib.h>
+
+#include "libswscale/swscale.h"
+#include "libavutil/mem.h"
+#include "libavutil/common.h"
+
+#define JPEG_MIN_QUALITY 10
+#define JPEG_MAX_QUALITY 95
+#define JPEG_QUALITY_STEP 15
+
+// libjpeg reads raw data by whole MCUs, rows and columns are padded to a multiple of this
+#define MCU_SIZE 16
+
+// An image is uniform if this share of its pixels (in permille) fall in the same luma bin,
+// or if its mean luma is below UNIFORM_DARK_LUMA
+#define UNIFORM_HISTOGRAM_BINS 32
+#define UNIFORM_MAX_BIN_PERMILLE 900
+#define UNIFORM_DARK_LUMA 20
+
+#define DHASH_COLS 9
+#define DHASH_ROWS 8
+
+typedef struct {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jmp;
+} jpeg_error_t;
+
+typedef struct {
+    uint8_t *buf;
+    size_t buf_len;
+    uint8_t *planes[3];
+    int linesize[3];
+    int width;
+    int height;
+} tn_frame_t;
+
+/*
+ * Per-thread state, kept from one thumbnail to the next
+ */
+typedef struct {
+    // [0] scales the source image, [1] scales a thumbnail to the next smaller size
+    struct SwsContext *sws_ctx[2];
+    tn_frame_t frames[2];
+
+    tn_frame_t sheet;
+    int sheet_cols;
+    int sheet_capacity;
+    int sheet_count;
+    int sheet_cell_w;
+    int sheet_cell_h;
+
+    struct jpeg_compress_struct cinfo;
+    jpeg_error_t err;
+    int cinfo_initialized;
+
+    unsigned char *jpeg_buf;
+    unsigned long jpeg_buf_len;
+    // Destination of jpeg_mem_dest(), kept out of the stack so that it survives the longjmp
+    unsigned char *jpeg_out_buf;
+    unsigned long jpeg_out_len;
+} thumbnail_thread_t;
+
+static __thread thumbnail_thread_t thread_tn;
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+    longjmp(((jpeg_error_t *) cinfo->err)->jmp, 1);
+}
+
+static void jpeg_output_message(j_common_ptr cinfo) {
+    // Ignore
+}
+
+int thumbnail_fit(int src_w, int src_h, int tn_size, int *dst_w, int *dst_h) {
+
+    if (src_w <= tn_size && src_h <= tn_size) {
+        *dst_w = src_w;
+        *dst_h = src_h;
+    } else {
+        double ratio = (double) src_w / src_h;
+        if (src_w > src_h) {
+            *dst_w = tn_size;
+            *dst_h = (int) (tn_size / ratio);
+        } else {
+            *dst_w = (int) (tn_size * ratio);
+            *dst_h = tn_size;
+        }
+    }
+
+    return *dst_w > THUMBNAIL_MIN_SIZE && *dst_h > THUMBNAIL_MIN_SIZE;
+}
+
+/*
+ * Rough equivalent of ffmpeg's MJPEG qscale (1-31) as a libjpeg quality (95-10)
+ */
+static int qscale_to_quality(float qscale) {
+    int quality = (int) (JPEG_MAX_QUALITY - (qscale - 1.0f) * (JPEG_MAX_QUALITY - JPEG_MIN_QUALITY) / 30.0f);
+    return MAX(JPEG_MIN_QUALITY, MIN(JPEG_MAX_QUALITY, quality));
+}
+
+static int jpeg_encode_raw(uint8_t **planes, const int *linesize, int w, int h, int gray, int quality) {
+
+    struct jpeg_compress_struct *cinfo = &thread_tn.cinfo;
+
+    if (!thread_tn.cinfo_initialized) {
+        cinfo->err = jpeg_std_error(&thread_tn.err.mgr);
+        thread_tn.err.mgr.error_exit = jpeg_error_exit;
+        thread_tn.err.mgr.output_message = jpeg_output_message;
+        jpeg_create_compress(cinfo);
+        thread_tn.cinfo_initialized = TRUE;
+    }
+
+    // libjpeg reallocates the output buffer if it is too small, the new one becomes ours
+    thread_tn.jpeg_out_buf = thread_tn.jpeg_buf;
+    thread_tn.jpeg_out_len = thread_tn.jpeg_buf_len;
+
+    if (setjmp(thread_tn.err.jmp)) {
+        jpeg_abort_compress(cinfo);
+        // The cached buffer is left untouched by libjpeg, only free the one it allocated
+        if (thread_tn.jpeg_out_buf != thread_tn.jpeg_buf) {
+            free(thread_tn.jpeg_out_buf);
+        }
+        thread_tn.jpeg_out_buf = NULL;
+        thread_tn.jpeg_out_len = 0;
+        return FALSE;
+    }
+
+    jpeg_mem_dest(cinfo, &thread_tn.jpeg_out_buf, &thread_tn.jpeg_out_len);
+
+    cinfo->image_width = w;
+    cinfo->image_height = h;
+    cinfo->input_components = gray ? 1 : 3;
+    cinfo->in_color_space = gray ? JCS_GRAYSCALE : JCS_YCbCr;
+    jpeg_set_defaults(cinfo);
+    jpeg_set_quality(cinfo, quality, TRUE);
+
+    // The planes are already subsampled, skip libjpeg's color conversion and downsampling
+    cinfo->raw_data_in = TRUE;
+#if JPEG_LIB_VERSION >= 70
+    cinfo->do_fancy_downsampling = FALSE;
+#endif
+    if (gray) {
+        cinfo->comp_info[0].h_samp_factor = 1;
+        cinfo->comp_info[0].v_samp_factor = 1;
+    } else {
+        cinfo->comp_info[0].h_samp_factor = 2;
+        cinfo->comp_info[0].v_samp_factor = 2;
+        cinfo->comp_info[1].h_samp_factor = 1;
+        cinfo->comp_info[1].v_samp_factor = 1;
+        cinfo->comp_info[2].h_samp_factor = 1;
+        cinfo->comp_info[2].v_samp_factor = 1;
+    }
+
+    jpeg_start_compress(cinfo, TRUE);
+
+    JSAMPROW y_rows[MCU_SIZE];
+    JSAMPROW u_rows[MCU_SIZE / 2];
+    JSAMPROW v_rows[MCU_SIZE / 2];
+    JSAMPARRAY data[3] = {y_rows, u_rows, v_rows};
+
+    int mcu_rows = gray ? DCTSIZE : MCU_SIZE;
+    int chroma_h = (h + 1) / 2;
+
+    while (cinfo->next_scanline < cinfo->image_height) {
+        int y = (int) cinfo->next_scanline;
+
+        // Repeat the last row in the padding
+        for (int i = 0; i < mcu_rows; i++) {
+            y_rows[i] = planes[0] + MIN(y + i, h - 1) * linesize[0];
+        }
+        if (!gray) {
+            for (int i = 0; i < mcu_rows / 2; i++) {
+                int row = MIN(y / 2 + i, chroma_h - 1);
+                u_rows[i] = planes[1] + row * linesize[1];
+                v_rows[i] = planes[2] + row * linesize[2];
+            }
+        }
+
+        jpeg_write_raw_data(cinfo, data, mcu_rows);
+    }
+
+    jpeg_finish_compress(cinfo);
+
+    if (thread_tn.jpeg_out_buf != thread_tn.jpeg_buf) {
+        free(thread_tn.jpeg_buf);
+        thread_tn.jpeg_buf = thread_tn.jpeg_out_buf;
+    }
+    // jpeg_out_len is now the size of the JPEG, which is at most the size of the buffer
+    unsigned long out_len = thread_tn.jpeg_out_len;
+    thread_tn.jpeg_buf_len = MAX(thread_tn.jpeg_buf_len, out_len);
+    thread_tn.jpeg_out_buf = NULL;
+    thread_tn.jpeg_out_len = 0;
+
+    return (int) out_len;
+}
+
+static void frame_alloc(tn_frame_t *frame, int w, int h, int gray) {
+
+    // Planes padded to whole MCUs
+    frame->linesize[0] = FFALIGN(w, MCU_SIZE);
+    frame->linesize[1] = gray ? 0 : frame->linesize[0] / 2;
+    frame->linesize[2] = frame->linesize[1];
+
+    size_t y_size = (size_t) frame->linesize[0] * h;
+    size_t chroma_size = (size_t) frame->linesize[1] * ((h + 1) / 2);
+
+    size_t buf_len = y_size + 2 * chroma_size;
+    if (buf_len > frame->buf_len) {
+        av_free(frame->buf);
+        frame->buf = av_mallocz(buf_len);
+        frame->buf_len = buf_len;
+    }
+
+    frame->planes[0] = frame->buf;
+    frame->planes[1] = frame->buf + y_size;
+    frame->planes[2] = frame->buf + y_size + chroma_size;
+    frame->width = w;
+    frame->height = h;
+}
+
+static int frame_is_uniform(const tn_frame_t *frame) {
+
+    uint32_t histogram[UNIFORM_HISTOGRAM_BINS] = {0};
+    uint64_t sum = 0;
+
+    for (int y = 0; y < frame->height; y++) {
+        const uint8_t *row = frame->planes[0] + y * frame->linesize[0];
+        for (int x = 0; x < frame->width; x++) {
+            histogram[row[x] / (256 / UNIFORM_HISTOGRAM_BINS)] += 1;
+            sum += row[x];
+        }
+    }
+
+    uint64_t pixels = (uint64_t) frame->width * frame->height;
+    uint32_t max_bin = 0;
+    for (int i = 0; i < UNIFORM_HISTOGRAM_BINS; i++) {
+        max_bin = MAX(max_bin, histogram[i]);
+    }
+
+    return max_bin * 1000 >= pixels * UNIFORM_MAX_BIN_PERMILLE || sum / pixels < UNIFORM_DARK_LUMA;
+}
+
+/*
+ * 64-bit difference hash: the luma plane is averaged down to 9x8 cells, each bit is set if a
+ * cell is brighter than the one on its right
+ */
+static uint64_t luma_dhash(const tn_frame_t *frame) {
+
+    uint32_t sums[DHASH_ROWS][DHASH_COLS] = {0};
+    uint32_t counts[DHASH_ROWS][DHASH_COLS] = {0};
+
+    for (int y = 0; y < frame->height; y++) {
+        const uint8_t *row = frame->planes[0] + y * frame->linesize[0];
+        int cell_y = y * DHASH_ROWS / frame->height;
+
+        // Sum by runs of pixels in the same cell, this loop is vectorized
+        int x = 0;
+        while (x < frame->width) {
+            int cell_x = x * DHASH_COLS / frame->width;
+            int end = ((cell_x + 1) * frame->width + DHASH_COLS - 1) / DHASH_COLS;
+
+            uint32_t sum = 0;
+            for (int i = x; i < end; i++) {
+                sum += row[i];
+            }
+            sums[cell_y][cell_x] += sum;
+            counts[cell_y][cell_x] += end - x;
+            x = end;
+        }
+    }
+
+    uint64_t hash = 0;
+    for (int y = 0; y < DHASH_ROWS; y++) {
+        for (int x = 0; x < DHASH_COLS - 1; x++) {
+            // Compare the means without dividing: a/ca > b/cb
+            uint64_t left = (uint64_t) sums[y][x] * counts[y][x + 1];
+            uint64_t right = (uint64_t) sums[y][x + 1] * counts[y][x];
+            hash = (hash << 1) | (left > right);
+        }
+    }
+
+    return hash;
+}
+
+static int scale_frame(struct SwsContext **sws_ctx, tn_frame_t *dst, const uint8_t *const *src,
+                       const int *src_linesize, int src_w, int src_h, enum AVPixelFormat src_fmt,
+                       int dst_w, int dst_h, int gray) {
+
+    *sws_ctx = sws_getCachedContext(
+            *sws_ctx,
+            src_w, src_h, src_fmt,
+            dst_w, dst_h, gray ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUVJ420P,
+            SIST_SWS_ALGO, 0, 0, 0
+    );
+    if (*sws_ctx == NULL) {
+        return FALSE;
+    }
+
+    frame_alloc(dst, dst_w, dst_h, gray);
+
+    sws_scale(*sws_ctx,
+              src, src_linesize,
+              0, src_h,
+              dst->planes, dst->linesize
+    );
+
+    return TRUE;
+}
+
+static int encode_frame(tn_frame_t *frame, int gray, float qscale, size_t max_size, thumbnail_t *tn) {
+
+    if (thread_tn.jpeg_buf_len < frame->buf_len) {
+        free(thread_tn.jpeg_buf);
+        thread_tn.jpeg_buf = malloc(frame->buf_len);
+        thread_tn.jpeg_buf_len = frame->buf_len;
+    }
+
+    int quality = qscale_to_quality(qscale);
+    int size;
+    while (TRUE) {
+        size = jpeg_encode_raw(frame->planes, frame->linesize, frame->width, frame->height, gray, quality);
+
+        if (size <= 0 || max_size == 0 || (size_t) size <= max_size || quality == JPEG_MIN_QUALITY) {
+            break;
+        }
+        quality = MAX(JPEG_MIN_QUALITY, quality - JPEG_QUALITY_STEP);
+    }
+
+    if (size <= 0) {
+        return FALSE;
+    }
+
+    tn->width = frame->width;
+    tn->height = frame->height;
+    tn->data = thread_tn.jpeg_buf;
+    tn->size = size;
+
+    return TRUE;
+}
+
+int thumbnail_encode(const uint8_t *const *src, const int *src_linesize, int src_w, int src_h,
+                     enum AVPixelFormat src_fmt, int dst_w, int dst_h, float qscale, size_t max_size,
+                     int skip_uniform, thumbnail_t *tn) {
+
+    int gray = src_fmt == AV_PIX_FMT_GRAY8;
+    tn_frame_t *frame = &thread_tn.frames[0];
+
+    if (!scale_frame(&thread_tn.sws_ctx[0], frame, src, src_linesize, src_w, src_h, src_fmt, dst_w, dst_h, gray)) {
+        return FALSE;
+    }
+
+    if (skip_uniform && frame_is_uniform(frame)) {
+        return THUMBNAIL_UNIFORM;
+    }
+
+    return encode_frame(frame, gray, qscale, max_size, tn);
+}
+
+int thumbnail_sheet_begin(int src_w, int src_h, int tn_size, int frame_count) {
+
+    int cols = (int) ceil(sqrt(frame_count));
+    int rows = (frame_count + cols - 1) / cols;
+
+    int cell_w;
+    int cell_h;
+    if (!thumbnail_fit(src_w, src_h, tn_size / cols, &cell_w, &cell_h)) {
+        return FALSE;
+    }
+
+    // Even cell dimensions so that the chroma planes are aligned on cells too
+    thread_tn.sheet_cell_w = cell_w & ~1;
+    thread_tn.sheet_cell_h = cell_h & ~1;
+    thread_tn.sheet_cols = cols;
+    thread_tn.sheet_capacity = cols * rows;
+    thread_tn.sheet_count = 0;
+
+    tn_frame_t *sheet = &thread_tn.sheet;
+    frame_alloc(sheet, cols * thread_tn.sheet_cell_w, rows * thread_tn.sheet_cell_h, FALSE);
+
+    // Black background
+    size_t y_size = (size_t) sheet->linesize[0] * sheet->height;
+    memset(sheet->planes[0], 0, y_size);
+    memset(sheet->planes[1], 128, (size_t) sheet->linesize[1] * ((sheet->height + 1) / 2) * 2);
+
+    return TRUE;
+}
+
+int thumbnail_sheet_add(const uint8_t *const *src, const int *src_linesize, int src_w, int src_h,
+                        enum AVPixelFormat src_fmt, int skip_uniform) {
+
+    if (thread_tn.sheet_count >= thread_tn.sheet_capacity) {
+        return FALSE;
+    }
+
+    int cell_w = thread_tn.sheet_cell_w;
+    int cell_h = thread_tn.sheet_cell_h;
+
+    tn_frame_t *frame = &thread_tn.frames[0];
+    if (!scale_frame(&thread_tn.sws_ctx[0], frame, src, src_linesize, src_w, src_h, src_fmt, cell_w, cell_h, FALSE)) {
+        return FALSE;
+    }
+
+    if (skip_uniform && frame_is_uniform(frame)) {
+        return THUMBNAIL_UNIFORM;
+    }
+
+    tn_frame_t *sheet = &thread_tn.sheet;
+    int x = (thread_tn.sheet_count % thread_tn.sheet_cols) * cell_w;
+    int y = (thread_tn.sheet_count / thread_tn.sheet_cols) * cell_h;
+
+    for (int row = 0; row < cell_h; row++) {
+        memcpy(sheet->planes[0] + (y + row) * sheet->linesize[0] + x,
+               frame->planes[0] + row * frame->linesize[0], cell_w);
+    }
+    for (int plane = 1; plane < 3; plane++) {
+        for (int row = 0; row < cell_h / 2; row++) {
+            memcpy(sheet->planes[plane] + (y / 2 + row) * sheet->linesize[plane] + x / 2,
+                   frame->planes[plane] + row * frame->linesize[plane], cell_w / 2);
+        }
+    }
+
+    thread_tn.sheet_count += 1;
+    return TRUE;
+}
+
+int thumbnail_sheet_encode(float qscale, size_t max_size, thumbnail_t *tn) {
+
+    int count = thread_tn.sheet_count;
+    if (count == 0) {
+        return FALSE;
+    }
+
+    // Crop the empty cells at the end
+    tn_frame_t *sheet = &thread_tn.sheet;
+    sheet->width = MIN(count, thread_tn.sheet_cols) * thread_tn.sheet_cell_w;
+    sheet->height = ((count + thread_tn.sheet_cols - 1) / thread_tn.sheet_cols) * thread_tn.sheet_cell_h;
+
+    return encode_frame(sheet, FALSE, qscale, max_size, tn);
+}
+
+static int compare_sizes_desc(const void *a, const void *b) {
+    return *(const int *) b - *(const int *) a;
+}
+
+int thumbnail_store_sizes(store_callback_t store, document_t *doc, const uint8_t *const *src,
+                          const int *src_linesize, int src_w, int src_h, enum AVPixelFormat src_fmt,
+                          int tn_size, const int *tn_sizes, float qscale, size_t max_size, int dhash) {
+
+    int sizes[THUMBNAIL_MAX_SIZES + 1];
+    int size_count = 0;
+
+    sizes[size_count++] = tn_size;
+    for (int i = 0; tn_sizes != NULL && i < THUMBNAIL_MAX_SIZES && tn_sizes[i] > 0; i++) {
+        if (tn_sizes[i] < tn_size) {
+            sizes[size_count++] = tn_sizes[i];
+        }
+    }
+    qsort(sizes + 1, size_count - 1, sizeof(int), compare_sizes_desc);
+
+    int gray = src_fmt == AV_PIX_FMT_GRAY8;
+    enum AVPixelFormat frame_fmt = gray ? AV_PIX_FMT_GRAY8 : AV_PIX_FMT_YUVJ420P;
+
+    int dims[(THUMBNAIL_MAX_SIZES + 1) * 2];
+    tn_frame_t *prev = NULL;
+    int stored = 0;
+
+    for (int i = 0; i < size_count; i++) {
+        int dst_w;
+        int dst_h;
+        if (!thumbnail_fit(src_w, src_h, sizes[i], &dst_w, &dst_h)) {
+            break;
+        }
+        if (prev != NULL && dst_w == prev->width && dst_h == prev->height) {
+            continue;
+        }
+
+        // Scale each thumbnail from the previous (larger) one, alternating between the two frames
+        tn_frame_t *frame = &thread_tn.frames[stored % 2];
+        int ret;
+        if (prev == NULL) {
+            ret = scale_frame(&thread_tn.sws_ctx[0], frame, src, src_linesize, src_w, src_h, src_fmt,
+                              dst_w, dst_h, gray);
+        } else {
+            ret = scale_frame(&thread_tn.sws_ctx[1], frame, (const uint8_t *const *) prev->planes, prev->linesize,
+                              prev->width, prev->height, frame_fmt, dst_w, dst_h, gray);
+        }
+
+        thumbnail_t tn;
+        if (!ret || !encode_frame(frame, gray, qscale, max_size, &tn)) {
+            break;
+        }
+
+        if (dhash && stored == 0) {
+            APPEND_LONG_META(doc, MetaThumbnailDHash, luma_dhash(frame))
+        }
+
+        thumbnail_store_index(store, doc, stored, &tn);
+        dims[stored * 2] = tn.width;
+        dims[stored * 2 + 1] = tn.height;
+
+        prev = frame;
+        stored += 1;
+    }
+
+    thumbnail_append_meta(doc, dims, stored);
+
+    return stored;
+}
+
+void thumbnail_store_index(store_callback_t store, document_t *doc, int index, const thumbnail_t *tn) {
+    if (index == 0) {
+        store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) tn->data, tn->size);
+        return;
+    }
+
+    char key[sizeof(doc->path_md5) + 1];
+    memcpy(key, doc->path_md5, sizeof(doc->path_md5));
+    key[sizeof(doc->path_md5)] = (char) index;
+
+    store(key, sizeof(key), (char *) tn->data, tn->size);
+}
+
+void thumbnail_append_meta(document_t *doc, const int *dims, int count) {
+    if (count <= 0) {
+        return;
+    }
+
+    meta_line_t *meta = malloc(sizeof(meta_line_t) + count * 24);
+    meta->key = MetaThumbnail;
+
+    char *ptr = meta->str_val;
+    for (int i = 0; i < count; i++) {
+        ptr += sprintf(ptr, i == 0 ? "%04d,%04d" : ",%04d,%04d", dims[i * 2], dims[i * 2 + 1]);
+    }
+
+    APPEND_META(doc, meta)
+}
+
+void thumbnail_store(store_callback_t store, document_t *doc, const thumbnail_t *tn) {
+    APPEND_TN_META(doc, tn->width, tn->height)
+    store((char *) doc->path_md5, sizeof(doc->path_md5), (char *) tn->data, tn->size);
+}
+
+void cleanup_thumbnail() {
+    for (int i = 0; i < 2; i++) {
+        sws_freeContext(thread_tn.sws_ctx[i]);
+        thread_tn.sws_ctx[i] = NULL;
+
+        av_freep(&thread_tn.frames[i].buf);
+        thread_tn.frames[i].buf_len = 0;
+    }
+    av_freep(&thread_tn.sheet.buf);
+    thread_tn.sheet.buf_len = 0;
+
+    if (thread_tn.cinfo_initialized) {
+        jpeg_destroy_compress(&thread_tn.cinfo);
+        thread_tn.cinfo_initialized = FALSE;
+    }
+
+    free(thread_tn.jpeg_buf);
+    thread_tn.jpeg_buf = NULL;
+    thread_tn.jpeg_buf_len = 0;
+}
@@ -0,0 +1,83 @@
+#ifndef SCAN_THUMBNAIL_H
+#define SCAN_THUMBNAIL_H
+
+#include "../scan.h"
+#include "libavutil/pixfmt.h"
+
+#define THUMBNAIL_MIN_SIZE 32
+// Maximum number of additional thumbnail sizes
+#define THUMBNAIL_MAX_SIZES 4
+// Returned instead of encoding an image that is (almost) a single color, see skip_uniform
+#define THUMBNAIL_UNIFORM (-1)
+
+typedef struct {
+    int width;
+    int height;
+    // JPEG data owned by the calling thread, valid until its next thumbnail_encode() call
+    unsigned char *data;
+    size_t size;
+} thumbnail_t;
+
+/*
+ * Dimensions of a thumbnail that fits in a tn_size square (never upscaled).
+ * Returns FALSE if the thumbnail would be smaller than THUMBNAIL_MIN_SIZE
+ */
+int thumbnail_fit(int src_w, int src_h, int tn_size, int *dst_w, int *dst_h);
+
+/*
+ * Scale the image to dst_w x dst_h and encode it to JPEG with libjpeg.
+ * src_fmt can be any format supported by swscale (RGB24, YUV420P, GRAY8...), grayscale images are
+ * encoded as single-component JPEGs. qscale uses ffmpeg's scale: 1.0 is the best quality, 31.0 the worst.
+ * If max_size is not 0, the quality is lowered until the JPEG is at most max_size bytes (or the lowest
+ * quality is reached). With skip_uniform, black or single color images are not encoded and
+ * THUMBNAIL_UNIFORM is returned.
+ */
+int thumbnail_encode(const uint8_t *const *src, const int *src_linesize, int src_w, int src_h,
+                     enum AVPixelFormat src_fmt, int dst_w, int dst_h, float qscale, size_t max_size,
+                     int skip_uniform, thumbnail_t *tn);
+
+/*
+ * Contact sheet (per-thread): a grid of up to frame_count src_w x src_h images, that fits in tn_size
+ */
+int thumbnail_sheet_begin(int src_w, int src_h, int tn_size, int frame_count);
+
+/*
+ * Add an image to the next cell of the contact sheet, see thumbnail_encode() for skip_uniform
+ */
+int thumbnail_sheet_add(const uint8_t *const *src, const int *src_linesize, int src_w, int src_h,
+                        enum AVPixelFormat src_fmt, int skip_uniform);
+
+/*
+ * Encode the contact sheet, without the empty cells. Returns FALSE if no image was added
+ */
+int thumbnail_sheet_encode(float qscale, size_t max_size, thumbnail_t *tn);
+
+void thumbnail_store(store_callback_t store, document_t *doc, const thumbnail_t *tn);
+
+/*
+ * Store a thumbnail without its MetaThumbnail: index 0 under the document's path_md5,
+ * the others under path_md5 followed by one byte, their index
+ */
+void thumbnail_store_index(store_callback_t store, document_t *doc, int index, const thumbnail_t *tn);
+
+/*
+ * Append a MetaThumbnail listing the dimensions of count thumbnails ("w0,h0,w1,h1...")
+ */
+void thumbnail_append_meta(document_t *doc, const int *dims, int count);
+
+/*
+ * Store a tn_size thumbnail, followed by one for each of the smaller tn_sizes (0-terminated, can be NULL).
+ * The image is decoded once, each thumbnail is scaled from the previous one.
+ *
+ * The thumbnails are stored with thumbnail_store_index() in that order, with a single MetaThumbnail.
+ * Sizes that would give the same dimensions as the previous one are skipped.
+ * With dhash, the difference hash of the tn_size thumbnail is appended as MetaThumbnailDHash.
+ * Returns the number of thumbnails stored.
+ */
+int thumbnail_store_sizes(store_callback_t store, document_t *doc, const uint8_t *const *src,
+                          const int *src_linesize, int src_w, int src_h, enum AVPixelFormat src_fmt,
+                          int tn_size, const int *tn_sizes, float qscale, size_t max_size, int dhash);
+
+void cleanup_thumbnail();
+
+#endif
@@ -324,6 +324,120 @@ static int text_buffer_append_markup(text_buffer_t *buf, const char *markup) {
     return 0;
 }
 
+typedef struct {
+    int tag_open;
+    // Incomplete UTF-8 sequence at the end of the previous chunk
+    char carry[4];
+    int carry_len;
+} markup_state_t;
+
+static void markup_state_init(markup_state_t *state) {
+    state->tag_open = TRUE;
+    state->carry_len = 0;
+}
+
+static int utf8_seq_len(char c) {
+    if (0xf0 == (0xf8 & c)) {
+        return 4;
+    } else if (0xe0 == (0xf0 & c)) {
+        return 3;
+    } else if (0xc0 == (0xe0 & c)) {
+        return 2;
+    }
+    return 1;
+}
+
+static int markup_append_text(text_buffer_t *buf, markup_state_t *state, const char *str, size_t len, int last) {
+
+    if (state->carry_len > 0) {
+        int seq_len = utf8_seq_len(state->carry[0]);
+        while (state->carry_len < seq_len && len > 0) {
+            state->carry[state->carry_len++] = *str++;
+            len -= 1;
+        }
+        if (state->carry_len < seq_len && !last) {
+            return 0;
+        }
+
+        char tmp[16] = {0};
+        memcpy(tmp, state->carry, state->carry_len);
+        state->carry_len = 0;
+
+        if (utf8_validchr2(tmp)) {
+            utf8_int32_t c;
+            utf8codepoint(tmp, &c);
+            if (text_buffer_append_char(buf, c) == TEXT_BUF_FULL) {
+                return TEXT_BUF_FULL;
+            }
+        }
+    }
+
+    if (!last && len > 0) {
+        // Keep a multi-byte sequence cut by the end of the chunk for the next one
+        size_t i = len - 1;
+        while (i > 0 && len - i < 4 && (0xc0 & str[i]) == 0x80) {
+            i -= 1;
+        }
+        if (len - i < utf8_seq_len(str[i])) {
+            state->carry_len = (int) (len - i);
+            memcpy(state->carry, str + i, state->carry_len);
+            len = i;
+        }
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+    return text_buffer_append_string(buf, str, len);
+}
+
+/*
+ * Same as text_buffer_append_markup(), for documents that are read one chunk
+ * at a time. The tag and partial UTF-8 sequence state are kept in `state`
+ */
+static int text_buffer_append_markup_chunk(text_buffer_t *buf, markup_state_t *state, const char *chunk, size_t len) {
+
+    const char *ptr = chunk;
+    const char *end = chunk + len;
+    const char *start = chunk;
+
+    while (ptr < end) {
+        if (state->tag_open) {
+            if (*ptr == '>') {
+                state->tag_open = FALSE;
+                start = ptr + 1;
+            }
+        } else if (*ptr == '<') {
+            state->tag_open = TRUE;
+            if (markup_append_text(buf, state, start, ptr - start, TRUE) == TEXT_BUF_FULL) {
+                return TEXT_BUF_FULL;
+            }
+            if (text_buffer_append_char(buf, ' ') == TEXT_BUF_FULL) {
+                return TEXT_BUF_FULL;
+            }
+        }
+
+        ptr += 1;
+    }
+
+    if (!state->tag_open && ptr != start) {
+        return markup_append_text(buf, state, start, ptr - start, FALSE);
+    }
+    return 0;
+}
+
+static int text_buffer_append_markup_end(text_buffer_t *buf, markup_state_t *state) {
+    int ret = 0;
+    if (!state->tag_open) {
+        ret = markup_append_text(buf, state, NULL, 0, TRUE);
+        if (ret != TEXT_BUF_FULL) {
+            ret = text_buffer_append_char(buf, ' ');
+        }
+    }
+    markup_state_init(state);
+    return ret;
+}
+
 static void *read_all(vfile_t *f, size_t *size) {
     void *buf = malloc(f->info.st_size);
     *size = f->read(f, buf, f->info.st_size);
@@ -336,6 +450,20 @@ static void *read_all(vfile_t *f, size_t *size) {
     return buf;
 }
 
+#define READ_TO_END_BUF_SIZE (1024 * 64)
+
+/*
+ * Consume the rest of the file through f->read(), for parsers that read the
+ * underlying file directly but still want the vfile to see (and checksum) every byte
+ */
+static void vfile_read_to_end(vfile_t *f) {
+    char *buf = malloc(READ_TO_END_BUF_SIZE);
+
+    while (f->read(f, buf, READ_TO_END_BUF_SIZE) > 0);
+
+    free(buf);
+}
+
 #define STACK_BUFFER_SIZE (size_t)(4096 * 8)
 
 __always_inline
@@ -54,11 +54,38 @@ void _parse_media(parse_job_t *job) {
     parse_media(&media_ctx, &job->vfile, &LastSubDoc, RecurseMediaMime);
 }
 
+static unsigned char LastSubSha1[SHA1_DIGEST_LENGTH];
+static int LastSubHasChecksum;
+
+void _parse_media_rewind(parse_job_t *job) {
+    // Like mime detection, read the first bytes before the parser
+    char buf[4096];
+    job->vfile.read_rewindable(&job->vfile, buf, sizeof(buf));
+
+    parse_media(&media_ctx, &job->vfile, &LastSubDoc, RecurseMediaMime);
+
+    LastSubHasChecksum = job->vfile.has_checksum;
+    memcpy(LastSubSha1, job->vfile.sha1_digest, SHA1_DIGEST_LENGTH);
+}
+
 void _parse_ooxml(parse_job_t *job) {
     parse_ooxml(&ooxml_500_ctx, &job->vfile, &LastSubDoc);
 }
 
 
+static unsigned char *read_test_file(const char *filepath, size_t *len) {
+    struct stat info;
+    stat(filepath, &info);
+    int fd = open(filepath, O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+    auto *buf = (unsigned char *) malloc(info.st_size);
+    *len = read(fd, buf, info.st_size);
+    close(fd);
+    return buf;
+}
+
 /* Text */
 
 TEST(Text, BookCsvContentLen) {
@@ -220,6 +247,26 @@ TEST(Ebook, CandlePdf) {
     cleanup(&doc, &f);
 }
 
+TEST(Ebook, CandlePdfSpread) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/ebook/General_-_Candle_Making.pdf", &f, &doc);
+
+    ebook_500_ctx.page_sample_mode = EBOOK_PAGES_SPREAD;
+    ebook_500_ctx.max_pages = 4;
+
+    parse_ebook(&ebook_500_ctx, &f, "application/pdf", &doc);
+
+    ebook_500_ctx.page_sample_mode = EBOOK_PAGES_SEQUENTIAL;
+    ebook_500_ctx.max_pages = 0;
+
+    ASSERT_NEAR(strlen(get_meta(&doc, MetaContent)->str_val), 500, 4);
+    ASSERT_GT(get_meta(&doc, MetaEstimatedContentSize)->long_val, 500);
+    ASSERT_EQ(get_meta(&doc, MetaPages)->long_val, 16);
+
+    cleanup(&doc, &f);
+}
+
 TEST(Ebook, Utf8Pdf) {
     vfile_t f;
     document_t doc;
@@ -297,9 +344,13 @@ TEST(Ebook, Epub1Fast) {
     document_t doc;
     load_doc_file("libscan-test-files/test_files/ebook/epub1.epub", &f, &doc);
 
+    size_t size_before = store_size;
+
     parse_ebook(&ebook_fast_ctx, &f, "application/epub+zip", &doc);
 
+    ASSERT_STREQ(get_meta(&doc, MetaTitle)->str_val, "Rabies");
     ASSERT_NEAR(strlen(get_meta(&doc, MetaContent)->str_val), 500, 4);
+    ASSERT_NE(size_before, store_size);
     cleanup(&doc, &f);
 }
 
@@ -315,6 +366,126 @@ TEST(Ebook, EpubBlankFirstPage) {
     cleanup(&doc, &f);
 }
 
+TEST(Ebook, CoverReuse) {
+    vfile_t f;
+    document_t doc;
+
+    size_t tn_size = 0;
+    char tn_meta[64] = {0};
+
+    // The cover buffers and mupdf context of this thread are reused, then freed and allocated again
+    for (int i = 0; i < 3; i++) {
+        load_doc_file("libscan-test-files/test_files/ebook/General_-_Candle_Making.pdf", &f, &doc);
+
+        size_t size_before = store_size;
+        parse_ebook(&ebook_500_ctx, &f, "application/pdf", &doc);
+
+        meta_line_t *meta = get_meta(&doc, MetaThumbnail);
+        ASSERT_NE(meta, nullptr);
+
+        int width;
+        int height;
+        ASSERT_EQ(sscanf(meta->str_val, "%d,%d", &width, &height), 2);
+        ASSERT_LE(MAX(width, height), ebook_500_ctx.tn_size);
+
+        if (i == 0) {
+            tn_size = store_size - size_before;
+            strncpy(tn_meta, meta->str_val, sizeof(tn_meta) - 1);
+        } else {
+            ASSERT_EQ(store_size - size_before, tn_size);
+            ASSERT_STREQ(meta->str_val, tn_meta);
+        }
+
+        cleanup(&doc, &f);
+
+        if (i == 1) {
+            cleanup_ebook();
+            cleanup_thumbnail();
+        }
+    }
+}
+
+TEST(Ebook, ContextReuse) {
+    vfile_t f;
+    document_t doc;
+
+    // The mupdf context of this thread is kept between documents of different types
+    const char *files[] = {
+            "libscan-test-files/test_files/ebook/epub1.epub",
+            "libscan-test-files/test_files/ebook/General_-_Candle_Making.pdf",
+            "libscan-test-files/test_files/ebook/epub1.epub",
+    };
+    const char *mimes[] = {"application/epub+zip", "application/pdf", "application/epub+zip"};
+    const char *titles[] = {"Rabies", "Microsoft Word - A531 Candlemaking-01.doc", "Rabies"};
+
+    for (int i = 0; i < 3; i++) {
+        load_doc_file(files[i], &f, &doc);
+
+        size_t size_before = store_size;
+        parse_ebook(&ebook_500_ctx, &f, mimes[i], &doc);
+
+        ASSERT_STREQ(get_meta(&doc, MetaTitle)->str_val, titles[i]);
+        ASSERT_NEAR(strlen(get_meta(&doc, MetaContent)->str_val), 500, 4);
+        ASSERT_NE(size_before, store_size);
+
+        cleanup(&doc, &f);
+    }
+}
+
+static int sha1_fs_read(vfile_t *f, void *buf, size_t size) {
+    int ret = (int) read(f->fd, buf, size);
+    if (ret > 0) {
+        SHA1_Update(&f->sha1_ctx, buf, ret);
+    }
+    return ret;
+}
+
+TEST(Ebook, PdfChecksum) {
+    vfile_t f;
+    document_t doc;
+    unsigned char digests[2][SHA1_DIGEST_LENGTH];
+
+    // Opened with the pread() stream, then read in memory like an archive entry
+    for (int i = 0; i < 2; i++) {
+        load_doc_file("libscan-test-files/test_files/ebook/General_-_Candle_Making.pdf", &f, &doc);
+        f.read = sha1_fs_read;
+        f.is_fs_file = i == 0;
+        SHA1_Init(&f.sha1_ctx);
+
+        parse_ebook(&ebook_500_ctx, &f, "application/pdf", &doc);
+
+        SHA1_Final(digests[i], &f.sha1_ctx);
+        ASSERT_EQ(get_meta(&doc, MetaPages)->long_val, 16);
+
+        cleanup(&doc, &f);
+    }
+
+    ASSERT_EQ(memcmp(digests[0], digests[1], SHA1_DIGEST_LENGTH), 0);
+}
+
+TEST(Ebook, EpubBlankFirstPageCover) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/ebook/EpubBlankFirstPage.epub", &f, &doc);
+
+    // Only the (blank) first page: uniform thumbnail
+    ebook_500_ctx.tn_dhash = TRUE;
+    ebook_500_ctx.tn_cover_search_pages = 1;
+    parse_ebook(&ebook_500_ctx, &f, "application/epub+zip", &doc);
+    ebook_500_ctx.tn_cover_search_pages = 0;
+
+    ASSERT_EQ(get_meta(&doc, MetaThumbnailDHash)->long_val, 0);
+    cleanup(&doc, &f);
+
+    // Default search: the cover is the second page
+    load_doc_file("libscan-test-files/test_files/ebook/EpubBlankFirstPage.epub", &f, &doc);
+    parse_ebook(&ebook_500_ctx, &f, "application/epub+zip", &doc);
+    ebook_500_ctx.tn_dhash = FALSE;
+
+    ASSERT_NE(get_meta(&doc, MetaThumbnailDHash)->long_val, 0);
+    cleanup(&doc, &f);
+}
+
 /* Comic */
 TEST(Comic, ComicCbz) {
     vfile_t f;
@@ -397,6 +568,88 @@ TEST(MediaImage, ExifGps1) {
 
     ASSERT_STREQ(get_meta(&doc, MetaExifGpsLongitudeRef)->str_val, "E");
     ASSERT_STREQ(get_meta(&doc, MetaExifGpsLongitudeDMS)->str_val, "9:1 , 28046900:1000000, 0:1");
+    ASSERT_TRUE(STR_STARTS_WITH(get_meta(&doc, MetaExifGpsLatitudeDec)->str_val, "48.94308998"));
+    ASSERT_TRUE(STR_STARTS_WITH(get_meta(&doc, MetaExifGpsLongitudeDec)->str_val, "9.46744833"));
+
+    cleanup(&doc, &f);
+}
+
+TEST(MediaImage, JpegLowres) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/exiftest1.jpg", &f, &doc);
+
+    size_t size_before = store_size;
+    parse_media(&media_ctx, &f, &doc, "image/jpeg");
+
+    // Decoded at reduced resolution, but the thumbnail is still full size
+    ASSERT_NE(size_before, store_size);
+    ASSERT_NE(strstr(get_meta(&doc, MetaThumbnail)->str_val, "0500"), nullptr);
+
+    cleanup(&doc, &f);
+}
+
+TEST(MediaImage, MaxPixels) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/exiftest1.jpg", &f, &doc);
+
+    media_ctx.tn_max_pixels = 1000;
+
+    size_t size_before = store_size;
+    parse_media(&media_ctx, &f, &doc, "image/jpeg");
+
+    media_ctx.tn_max_pixels = 0;
+
+    // Too large even at 1/8 scale: no thumbnail, but the metadata is still read
+    ASSERT_EQ(size_before, store_size);
+    ASSERT_EQ(get_meta(&doc, MetaThumbnail), nullptr);
+    ASSERT_GT(get_meta(&doc, MetaWidth)->long_val, 0);
+    ASSERT_STREQ(get_meta(&doc, MetaMediaVideoCodec)->str_val, "mjpeg");
+
+    cleanup(&doc, &f);
+}
+
+TEST(MediaImage, ExifMetadataOnly) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/exiftest1.jpg", &f, &doc);
+
+    media_ctx.tn_size = 0;
+
+    size_t size_before = store_size;
+    parse_media(&media_ctx, &f, &doc, "image/jpeg");
+
+    media_ctx.tn_size = 500;
+
+    ASSERT_EQ(size_before, store_size);
+    ASSERT_EQ(get_meta(&doc, MetaThumbnail), nullptr);
+    ASSERT_STREQ(get_meta(&doc, MetaMediaVideoCodec)->str_val, "mjpeg");
+    ASSERT_NE(get_meta(&doc, MetaWidth), nullptr);
+    ASSERT_STREQ(get_meta(&doc, MetaExifMake)->str_val, "NIKON CORPORATION");
+    ASSERT_STREQ(get_meta(&doc, MetaExifExposureTime)->str_val, "1:160");
+
+    cleanup(&doc, &f);
+}
+
+TEST(MediaImage, ExifThumbnail) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/exiftest1.jpg", &f, &doc);
+
+    media_ctx.tn_exif_min_size = 100;
+
+    size_t size_before = store_size;
+    parse_media(&media_ctx, &f, &doc, "image/jpeg");
+
+    media_ctx.tn_exif_min_size = 0;
+
+    // Metadata is the same with or without the embedded thumbnail
+    ASSERT_NE(size_before, store_size);
+    ASSERT_NE(get_meta(&doc, MetaThumbnail), nullptr);
+    ASSERT_STREQ(get_meta(&doc, MetaExifMake)->str_val, "NIKON CORPORATION");
+    ASSERT_STREQ(get_meta(&doc, MetaExifFNumber)->str_val, "53:10");
+    ASSERT_STREQ(get_meta(&doc, MetaArtist)->str_val, "FinalDoom");
 
     cleanup(&doc, &f);
 }
@@ -457,6 +710,78 @@ TEST(MediaImage, AsIsFs) {
     cleanup(&doc, &f);
 }
 
+TEST(MediaImage, DHash) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/9555.jpg", &f, &doc);
+
+    size_t size_before = store_size;
+
+    media_ctx.tn_dhash = TRUE;
+    parse_media(&media_ctx, &f, &doc, "image/jpeg");
+    media_ctx.tn_dhash = FALSE;
+
+    // Re-encoded instead of stored as-is
+    ASSERT_NE(size_before + 14098, store_size);
+    ASSERT_TRUE(HAS_META_KEY(&doc, MetaThumbnailDHash));
+    long dhash = get_meta(&doc, MetaThumbnailDHash)->long_val;
+    ASSERT_NE(dhash, 0);
+
+    cleanup(&doc, &f);
+
+    // Same hash for the same image
+    load_doc_file("libscan-test-files/test_files/media/9555.jpg", &f, &doc);
+    media_ctx.tn_dhash = TRUE;
+    parse_media(&media_ctx, &f, &doc, "image/jpeg");
+    media_ctx.tn_dhash = FALSE;
+
+    ASSERT_EQ(get_meta(&doc, MetaThumbnailDHash)->long_val, dhash);
+
+    cleanup(&doc, &f);
+}
+
+TEST(MediaImage, DHashGradient) {
+    document_t doc;
+    doc.meta_head = nullptr;
+    doc.meta_tail = nullptr;
+
+    // Grayscale image that gets darker from left to right: every cell is brighter than the one on its right
+    const int width = 90;
+    const int height = 64;
+    char header[32];
+    int header_len = sprintf(header, "P5\n%d %d\n255\n", width, height);
+
+    size_t buf_len = header_len + width * height;
+    auto *buf = (unsigned char *) malloc(buf_len);
+    memcpy(buf, header, header_len);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            buf[header_len + y * width + x] = 255 - x * 2;
+        }
+    }
+
+    ASSERT_TRUE(store_image_thumbnails(&media_ctx, buf, buf_len, &doc, "gradient.pgm", nullptr, TRUE));
+    ASSERT_TRUE(HAS_META_KEY(&doc, MetaThumbnailDHash));
+    ASSERT_EQ((uint64_t) get_meta(&doc, MetaThumbnailDHash)->long_val, 0xFFFFFFFFFFFFFFFFULL);
+
+    destroy_doc(&doc);
+    doc.meta_head = nullptr;
+    doc.meta_tail = nullptr;
+
+    // Brighter from left to right: no bit set
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            buf[header_len + y * width + x] = x * 2;
+        }
+    }
+
+    ASSERT_TRUE(store_image_thumbnails(&media_ctx, buf, buf_len, &doc, "gradient.pgm", nullptr, TRUE));
+    ASSERT_EQ(get_meta(&doc, MetaThumbnailDHash)->long_val, 0);
+
+    free(buf);
+    destroy_doc(&doc);
+}
+
 TEST(MediaImage, Mem2AsIs) {
     vfile_t f;
     document_t doc;
@@ -472,6 +797,128 @@ TEST(MediaImage, Mem2AsIs) {
     cleanup(&doc, &f);
 }
 
+TEST(MediaVideo, VidMkvKeyframeOnly) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/berd.mkv", &f, &doc);
+
+    media_ctx.tn_keyframe_only = TRUE;
+    media_ctx.decoder_threads = 2;
+
+    size_t size_before = store_size;
+    parse_media(&media_ctx, &f, &doc, "video/x-matroska");
+
+    media_ctx.tn_keyframe_only = FALSE;
+    media_ctx.decoder_threads = 0;
+
+    ASSERT_NE(size_before, store_size);
+    ASSERT_NE(get_meta(&doc, MetaThumbnail), nullptr);
+
+    cleanup(&doc, &f);
+}
+
+TEST(MediaVideo, ThumbnailPipelineReuse) {
+    vfile_t f;
+    document_t doc;
+
+    size_t sizes[2];
+    for (size_t &size : sizes) {
+        load_doc_file("libscan-test-files/test_files/media/vid3.mp4", &f, &doc);
+
+        size_t size_before = store_size;
+        parse_media(&media_ctx, &f, &doc, "video/mp4");
+        size = store_size - size_before;
+
+        cleanup(&doc, &f);
+    }
+
+    // The second thumbnail goes through the cached scaler and JPEG compressor
+    ASSERT_NE(sizes[0], 0);
+    ASSERT_EQ(sizes[0], sizes[1]);
+}
+
+TEST(MediaVideo, ThumbnailMaxBytes) {
+    vfile_t f;
+    document_t doc;
+
+    size_t sizes[2];
+    size_t max_bytes[2] = {0, 1};
+    for (int i = 0; i < 2; i++) {
+        load_doc_file("libscan-test-files/test_files/media/vid3.mp4", &f, &doc);
+
+        size_t size_before = store_size;
+        media_ctx.tn_max_bytes = max_bytes[i];
+        parse_media(&media_ctx, &f, &doc, "video/mp4");
+        media_ctx.tn_max_bytes = 0;
+        sizes[i] = store_size - size_before;
+
+        ASSERT_NE(get_meta(&doc, MetaThumbnail), nullptr);
+        cleanup(&doc, &f);
+    }
+
+    // Can't fit in 1 byte, but stored at the lowest quality
+    ASSERT_NE(sizes[1], 0);
+    ASSERT_LT(sizes[1], sizes[0]);
+}
+
+TEST(MediaVideo, ThumbnailSizes) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/vid3.mp4", &f, &doc);
+
+    media_ctx.tn_sizes[0] = 100;
+    media_ctx.tn_sizes[1] = 250;
+    parse_media(&media_ctx, &f, &doc, "video/mp4");
+    media_ctx.tn_sizes[0] = 0;
+    media_ctx.tn_sizes[1] = 0;
+
+    // tn_size, 250px and 100px thumbnails, largest first
+    int w[3], h[3];
+    ASSERT_EQ(sscanf(get_meta(&doc, MetaThumbnail)->str_val, "%d,%d,%d,%d,%d,%d",
+                     &w[0], &h[0], &w[1], &h[1], &w[2], &h[2]), 6);
+    ASSERT_EQ(MAX(w[1], h[1]), 250);
+    ASSERT_EQ(MAX(w[2], h[2]), 100);
+    ASSERT_GT(w[0], w[1]);
+
+    cleanup(&doc, &f);
+}
+
+TEST(MediaVideo, ContactSheet) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/vid3.mp4", &f, &doc);
+
+    size_t size_before = store_size;
+    media_ctx.tn_frame_count = 4;
+    parse_media(&media_ctx, &f, &doc, "video/mp4");
+    media_ctx.tn_frame_count = 0;
+
+    ASSERT_NE(size_before, store_size);
+    ASSERT_NE(get_meta(&doc, MetaThumbnail), nullptr);
+    ASSERT_STREQ(get_meta(&doc, MetaMediaVideoCodec)->str_val, "h264");
+
+    cleanup(&doc, &f);
+}
+
+TEST(MediaVideo, SeparateFrames) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/vid3.mp4", &f, &doc);
+
+    media_ctx.tn_frame_count = 3;
+    media_ctx.tn_frames_separate = TRUE;
+    parse_media(&media_ctx, &f, &doc, "video/mp4");
+    media_ctx.tn_frame_count = 0;
+    media_ctx.tn_frames_separate = FALSE;
+
+    int w[3], h[3];
+    ASSERT_EQ(sscanf(get_meta(&doc, MetaThumbnail)->str_val, "%d,%d,%d,%d,%d,%d",
+                     &w[0], &h[0], &w[1], &h[1], &w[2], &h[2]), 6);
+    ASSERT_EQ(w[0], w[2]);
+
+    cleanup(&doc, &f);
+}
+
 TEST(MediaVideo, VidMkvSubDisabled) {
     vfile_t f;
     document_t doc;
@@ -502,6 +949,32 @@ TEST(MediaVideo, VidMkvSubEnabled) {
     cleanup(&doc, &f);
 }
 
+TEST(MediaVideo, VidMkvSubBudget) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/berd.mkv", &f, &doc);
+
+    // Stop reading the subtitles before the end of the file
+    long max_subtitle_bytes = f.info.st_size / 4;
+    ASSERT_GT(max_subtitle_bytes, 0);
+
+    size_t size_before = store_size;
+    media_ctx.read_subtitles = TRUE;
+    media_ctx.read_all_subtitle_streams = TRUE;
+    media_ctx.max_subtitle_bytes = max_subtitle_bytes;
+    parse_media(&media_ctx, &f, &doc, "video/x-matroska");
+    media_ctx.read_subtitles = FALSE;
+    media_ctx.read_all_subtitle_streams = FALSE;
+    media_ctx.max_subtitle_bytes = 0;
+
+    // The thumbnail is still decoded after the subtitle pass was cut short
+    ASSERT_NE(size_before, store_size);
+    ASSERT_NE(get_meta(&doc, MetaThumbnail), nullptr);
+    ASSERT_NE(get_meta(&doc, MetaContent), nullptr);
+
+    cleanup(&doc, &f);
+}
+
 TEST(MediaVideo, Vid3Mp4) {
     vfile_t f;
     document_t doc;
@@ -519,6 +992,29 @@ TEST(MediaVideo, Vid3Mp4) {
     cleanup(&doc, &f);
 }
 
+TEST(MediaVideo, Vid3Mp4MetadataOnly) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/vid3.mp4", &f, &doc);
+
+    media_ctx.metadata_only = TRUE;
+
+    size_t size_before = store_size;
+    parse_media(&media_ctx, &f, &doc, "video/mp4");
+
+    media_ctx.metadata_only = FALSE;
+
+    ASSERT_EQ(size_before, store_size);
+    ASSERT_EQ(get_meta(&doc, MetaThumbnail), nullptr);
+    ASSERT_STREQ(get_meta(&doc, MetaTitle)->str_val, "Helicopter (((Accident))) - "
+                                                     "https://archive.org/details/Virginia_Helicopter_Crash");
+    ASSERT_STREQ(get_meta(&doc, MetaMediaVideoCodec)->str_val, "h264");
+    ASSERT_EQ(get_meta(&doc, MetaMediaDuration)->long_val, 10);
+    ASSERT_NE(get_meta(&doc, MetaWidth), nullptr);
+
+    cleanup(&doc, &f);
+}
+
 TEST(MediaVideo, Vid3Ogv) {
     vfile_t f;
     document_t doc;
@@ -567,6 +1063,70 @@ TEST(MediaVideoVfile, Vid3Ogv) {
     cleanup(&doc, &f);
 }
 
+/*
+ * SHA1 of the first regular file of a tar archive
+ */
+static int tar_member_sha1(const char *filepath, unsigned char *digest) {
+    size_t len;
+    unsigned char *tar = read_test_file(filepath, &len);
+    if (tar == nullptr) {
+        return FALSE;
+    }
+
+    size_t offset = 0;
+    while (offset + 512 <= len && tar[offset] != '\0') {
+        size_t size = strtoul((char *) tar + offset + 124, nullptr, 8);
+        char type = (char) tar[offset + 156];
+
+        if ((type == '0' || type == '\0') && offset + 512 + size <= len) {
+            SHA1(tar + offset + 512, size, digest);
+            free(tar);
+            return TRUE;
+        }
+        offset += 512 + (size + 511) / 512 * 512;
+    }
+
+    free(tar);
+    return FALSE;
+}
+
+TEST(MediaVideoVfile, Vid3OgvSpill) {
+    vfile_t f;
+    document_t doc;
+
+    unsigned char expected_sha1[SHA1_DIGEST_LENGTH];
+    ASSERT_TRUE(tar_member_sha1("libscan-test-files/test_files/arc/vid3.tar", expected_sha1));
+
+    arc_recurse_media_ctx.parse = _parse_media_rewind;
+    RecurseMediaMime = (char *) "video/webm";
+
+    // In memory, then most of the file in a temporary file
+    long buffer_sizes[] = {(long) 2000 * (long) 1024 * (long) 1024, 1024 * 64};
+
+    for (long buffer_size : buffer_sizes) {
+        load_doc_file("libscan-test-files/test_files/arc/vid3.tar", &f, &doc);
+        media_ctx.max_media_buffer = buffer_size;
+        LastSubHasChecksum = FALSE;
+
+        size_t size_before = store_size;
+        parse_archive(&arc_recurse_media_ctx, &f, &doc, nullptr, nullptr);
+
+        media_ctx.max_media_buffer = (long) 2000 * (long) 1024 * (long) 1024;
+
+        ASSERT_EQ(get_meta(&LastSubDoc, MetaMediaBitrate)->long_val, 590261);
+        ASSERT_EQ(get_meta(&LastSubDoc, MetaMediaDuration)->long_val, 10);
+        ASSERT_NE(size_before, store_size);
+
+        // Also covers the bytes read before parse_media()
+        ASSERT_TRUE(LastSubHasChecksum);
+        ASSERT_EQ(memcmp(LastSubSha1, expected_sha1, SHA1_DIGEST_LENGTH), 0);
+
+        cleanup(&doc, &f);
+    }
+
+    arc_recurse_media_ctx.parse = _parse_media;
+}
+
 TEST(MediaVideo, VidDuplicateTags) {
     vfile_t f;
     document_t doc;
@@ -589,7 +1149,130 @@ TEST(MediaVideo, VidDuplicateTags) {
     cleanup(&doc, &f);
 }
 
-//TODO: test music file with embedded cover art
+static void write_be32(unsigned char *p, uint32_t value, int syncsafe) {
+    int shift = syncsafe ? 7 : 8;
+    for (int i = 3; i >= 0; i--) {
+        p[i] = value & (syncsafe ? 0x7F : 0xFF);
+        value >>= shift;
+    }
+}
+
+TEST(MediaAudio, MusicMp3CoverArt) {
+    size_t jpg_len;
+    size_t mp3_len;
+    unsigned char *jpg = read_test_file("libscan-test-files/test_files/media/9555.jpg", &jpg_len);
+    unsigned char *mp3 = read_test_file("libscan-test-files/test_files/media/02-The Watchmaker-Barry James_spoken.mp3",
+                                        &mp3_len);
+    ASSERT_NE(jpg, nullptr);
+    ASSERT_NE(mp3, nullptr);
+
+    // Replace the ID3v2 tag of the mp3 with one that only has an APIC (attached picture) frame
+    size_t audio_offset = 0;
+    if (memcmp(mp3, "ID3", 3) == 0) {
+        audio_offset = 10 + ((mp3[6] & 0x7F) << 21 | (mp3[7] & 0x7F) << 14 | (mp3[8] & 0x7F) << 7 | (mp3[9] & 0x7F));
+    }
+
+    const char apic_header[] = "\x00" "image/jpeg\x00" "\x03" "\x00";
+    size_t apic_len = sizeof(apic_header) - 1 + jpg_len;
+    size_t tag_len = 10 + apic_len;
+
+    size_t buf_len = 10 + tag_len + mp3_len - audio_offset;
+    auto *buf = (unsigned char *) malloc(buf_len);
+    memcpy(buf, "ID3\x03\x00\x00", 6);
+    write_be32(buf + 6, tag_len, TRUE);
+    memcpy(buf + 10, "APIC", 4);
+    write_be32(buf + 14, apic_len, FALSE);
+    memset(buf + 18, 0, 2);
+    memcpy(buf + 20, apic_header, sizeof(apic_header) - 1);
+    memcpy(buf + 20 + sizeof(apic_header) - 1, jpg, jpg_len);
+    memcpy(buf + 10 + tag_len, mp3 + audio_offset, mp3_len - audio_offset);
+
+    char filepath[] = "/tmp/libscan_cover_XXXXXX";
+    int fd = mkstemp(filepath);
+    ASSERT_NE(fd, -1);
+    ASSERT_EQ(write(fd, buf, buf_len), (ssize_t) buf_len);
+    close(fd);
+    free(buf);
+    free(mp3);
+    free(jpg);
+
+    vfile_t f;
+    document_t doc;
+    load_doc_file(filepath, &f, &doc);
+
+    size_t size_before = store_size;
+
+    parse_media(&media_ctx, &f, &doc, "audio/mpeg");
+
+    // Small enough to be stored as-is
+    ASSERT_EQ(size_before + jpg_len, store_size);
+    ASSERT_NE(get_meta(&doc, MetaThumbnail), nullptr);
+    ASSERT_STREQ(get_meta(&doc, MetaMediaAudioCodec)->str_val, "mp3");
+
+    cleanup(&doc, &f);
+    unlink(filepath);
+}
+
+TEST(MediaAudio, TagKeys) {
+    ASSERT_TRUE(media_tag_table_check());
+
+    struct {
+        const char *name;
+        int source;
+        metakey key;
+    } tags[] = {
+            {"title",           TAG_AUDIO, MetaTitle},
+            {"TITLE",           TAG_VIDEO, MetaTitle},
+            {"Artist",          TAG_EXIF,  MetaArtist},
+            {"album",           TAG_AUDIO, MetaAlbum},
+            {"album_artist",    TAG_AUDIO, MetaAlbumArtist},
+            {"genre",           TAG_AUDIO, MetaGenre},
+            {"comment",         TAG_VIDEO, MetaContent},
+            {"ImageDescription", TAG_EXIF, MetaContent},
+            {"make",            TAG_EXIF,  MetaExifMake},
+            {"model",           TAG_EXIF,  MetaExifModel},
+            {"software",        TAG_EXIF,  MetaExifSoftware},
+            {"FNumber",         TAG_EXIF,  MetaExifFNumber},
+            {"FocalLength",     TAG_EXIF,  MetaExifFocalLength},
+            {"UserComment",     TAG_EXIF,  MetaExifUserComment},
+            {"ISOSpeedRatings", TAG_EXIF,  MetaExifIsoSpeedRatings},
+            {"ExposureTime",    TAG_EXIF,  MetaExifExposureTime},
+            {"DateTime",        TAG_EXIF,  MetaExifDateTime},
+            {"GPSLatitude",     TAG_EXIF,  MetaExifGpsLatitudeDMS},
+            {"GPSLatitudeRef",  TAG_EXIF,  MetaExifGpsLatitudeRef},
+            {"GPSLongitude",    TAG_EXIF,  MetaExifGpsLongitudeDMS},
+            {"GPSLongitudeRef", TAG_EXIF,  MetaExifGpsLongitudeRef},
+    };
+    for (auto &tag : tags) {
+        ASSERT_EQ(media_tag_key(tag.name, tag.source), tag.key) << tag.name;
+    }
+
+    // Not read from this dictionary, unknown tags
+    ASSERT_EQ(media_tag_key("album", TAG_VIDEO), 0);
+    ASSERT_EQ(media_tag_key("make", TAG_AUDIO), 0);
+    ASSERT_EQ(media_tag_key("titles", TAG_AUDIO), 0);
+    ASSERT_EQ(media_tag_key("", TAG_AUDIO), 0);
+}
+
+TEST(MediaAudio, HasMetaKey) {
+    document_t doc;
+    doc.meta_head = nullptr;
+    doc.meta_tail = nullptr;
+    // Not initialized by the caller, ignored while the list is empty
+    doc.meta_keys = ~0ULL;
+
+    ASSERT_FALSE(HAS_META_KEY(&doc, MetaTitle));
+
+    auto *meta = (meta_line_t *) malloc(sizeof(meta_line_t));
+    meta->key = MetaTitle;
+    APPEND_META((&doc), meta)
+
+    ASSERT_TRUE(HAS_META_KEY(&doc, MetaTitle));
+    ASSERT_FALSE(HAS_META_KEY(&doc, MetaArtist));
+    ASSERT_FALSE(HAS_META_KEY(&doc, MetaThumbnailDHash));
+
+    destroy_doc(&doc);
+}
 
 TEST(MediaAudio, MusicMp3) {
     vfile_t f;
@@ -608,6 +1291,38 @@ TEST(MediaAudio, MusicMp3) {
     cleanup(&doc, &f);
 }
 
+TEST(MediaAudio, MusicMp3FastTags) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/media/02-The Watchmaker-Barry James_spoken.mp3", &f, &doc);
+
+    media_ctx.fast_audio_tags = TRUE;
+    parse_media(&media_ctx, &f, &doc, "audio/x-mpeg-3");
+    media_ctx.fast_audio_tags = FALSE;
+
+    ASSERT_STREQ(get_meta(&doc, MetaArtist)->str_val, "Barry James");
+    ASSERT_STREQ(get_meta(&doc, MetaAlbum)->str_val, "Strange Slumber, Music for Wonderful Dreams");
+    ASSERT_STREQ(get_meta(&doc, MetaTitle)->str_val, "The Watchmaker");
+    ASSERT_STREQ(get_meta(&doc, MetaGenre)->str_val, "New Age");
+    ASSERT_STREQ(get_meta(&doc, MetaContent)->str_val, "http://magnatune.com/artists/barry_james");
+    ASSERT_STREQ(get_meta(&doc, MetaMediaAudioCodec)->str_val, "mp3");
+    ASSERT_GT(get_meta(&doc, MetaMediaDuration)->long_val, 0);
+
+    // Same keys as when the file is read with ffmpeg, the durations are both approximate
+    vfile_t f_ffmpeg;
+    document_t doc_ffmpeg;
+    load_doc_file("libscan-test-files/test_files/media/02-The Watchmaker-Barry James_spoken.mp3", &f_ffmpeg,
+                  &doc_ffmpeg);
+    parse_media(&media_ctx, &f_ffmpeg, &doc_ffmpeg, "audio/x-mpeg-3");
+
+    ASSERT_EQ(doc.meta_keys, doc_ffmpeg.meta_keys);
+    ASSERT_NEAR(get_meta(&doc, MetaMediaDuration)->long_val,
+                get_meta(&doc_ffmpeg, MetaMediaDuration)->long_val, 1);
+
+    cleanup(&doc_ffmpeg, &f_ffmpeg);
+    cleanup(&doc, &f);
+}
+
 /* OOXML */
 
 TEST(Ooxml, Pptx1) {
@@ -803,6 +1518,64 @@ TEST(RAW, Panasonic) {
     cleanup(&doc, &f);
 }
 
+TEST(RAW, MetadataOnly) {
+    vfile_t f;
+    document_t doc;
+    load_doc_file("libscan-test-files/test_files/raw/Panasonic.RW2", &f, &doc);
+
+    raw_ctx.tn_size = 0;
+
+    size_t size_before = store_size;
+    parse_raw(&raw_ctx, &f, &doc);
+
+    raw_ctx.tn_size = 500;
+
+    ASSERT_EQ(size_before, store_size);
+    ASSERT_STREQ(get_meta(&doc, MetaExifModel)->str_val, "DMC-GX8");
+    ASSERT_EQ(get_meta(&doc, MetaWidth)->long_val, 5200);
+
+    cleanup(&doc, &f);
+}
+
+TEST(RAW, HandleReuse) {
+    vfile_t f;
+    document_t doc;
+
+    unsigned long reuse_before = raw_reuse_stats().handle_reuse;
+
+    for (int i = 0; i < 2; i++) {
+        load_doc_file("libscan-test-files/test_files/raw/Nikon.NEF", &f, &doc);
+
+        size_t size_before = store_size;
+        parse_raw(&raw_ctx, &f, &doc);
+
+        // Recycling the handle must not leak state between files
+        ASSERT_STREQ(get_meta(&doc, MetaExifModel)->str_val, "D750");
+        ASSERT_NE(size_before, store_size);
+
+        cleanup(&doc, &f);
+    }
+
+    ASSERT_GE(raw_reuse_stats().handle_reuse, reuse_before + 1);
+}
+
+TEST(RAW, PreviewSize) {
+    vfile_t f;
+    document_t doc;
+    // NEF files have a small (160x120) and a large JPEG preview
+    load_doc_file("libscan-test-files/test_files/raw/Nikon.NEF", &f, &doc);
+
+    parse_raw(&raw_ctx, &f, &doc);
+
+    // The thumbnail is scaled down from a preview that is at least tn_size
+    int width;
+    int height;
+    ASSERT_EQ(sscanf(get_meta(&doc, MetaThumbnail)->str_val, "%d,%d", &width, &height), 2);
+    ASSERT_EQ(MAX(width, height), raw_ctx.tn_size);
+
+    cleanup(&doc, &f);
+}
+
 TEST(RAW, ExifGps1) {
     vfile_t f;
     document_t doc;